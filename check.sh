@@ -0,0 +1,27 @@
+#!/bin/sh
+# Runs each script in check/ through the REPL in every evaluation mode
+# and diffs the output against the default mode's. The modes have to
+# agree on everything, errors included.
+./build.sh || exit 1
+
+expected=$(mktemp)
+actual=$(mktemp)
+trap 'rm -f "$expected" "$actual"' EXIT
+
+status=0
+for script in check/*.lspy; do
+  ./lispy < "$script" > "$expected" 2>&1
+  for mode in "--tree-walk" "--jit-threshold 1" "--jit-threshold 3" \
+              "--no-jit" "--no-fold" "--no-eval-cache" \
+              "--gc-threshold 100" "--nursery"; do
+    ./lispy $mode < "$script" > "$actual" 2>&1
+    if ! diff -u "$expected" "$actual" > /dev/null; then
+      echo "FAIL $script $mode"
+      diff -u "$expected" "$actual" | head -20
+      status=1
+    fi
+  done
+done
+
+[ $status -eq 0 ] && echo "all modes agree"
+exit $status
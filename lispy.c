@@ -1,11 +1,36 @@
+/* for posix_memalign and MAP_ANONYMOUS */
+#define _DEFAULT_SOURCE
+
 #include "mpc.h"
 
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+/* hot lambdas are compiled to native code where we know how, see JIT */
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+#define LJIT 1
+#include <sys/mman.h>
+#else
+#define LJIT 0
+#endif
+
+/* programs built by 'lispy --compile' include this file without a REPL */
+#ifndef LISPY_RUNTIME
 /* requires libedit-dev from apt */
 #include <editline/readline.h>
 #include <editline/history.h>
+#endif
 
 
 // Type Declarations
@@ -14,49 +39,679 @@ struct lval;
 typedef struct lval lval;
 struct lenv;
 typedef struct lenv lenv;
+struct llambda;
+struct lchunk;
+struct ljit;
 
 typedef enum {
   LVAL_ERR,
   LVAL_NUM,
+  LVAL_BIG,
+  LVAL_DBL,
   LVAL_SYM,
   LVAL_FUN,
   LVAL_SEXPR,
-  LVAL_QEXPR
+  LVAL_QEXPR,
+  LVAL_VEC
 } lval_type;
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/*
+ * Values are immutable once they are shared: every lval* you hold owns one
+ * reference, lval_ref adds another and lval_del releases one. Anything that
+ * wants to mutate a value in place must go through lval_unshare first.
+ */
 struct lval {
-  lval_type type;
-
-  long num;
-  char* err;
-  char* sym;
-  lbuiltin fun;
+  unsigned char type;   /* an lval_type */
+  unsigned char young;  /* allocated in the nursery */
+  unsigned char marked; /* reached by the current collection */
+  unsigned char dead;   /* a released cell, see lval_free */
+  int refs;
+
+  union {
+    long num;   /* LVAL_NUM, only when too big to be a fixnum */
+    double dbl; /* LVAL_DBL, only when it can't be a flonum */
+    char* err; /* LVAL_ERR */
+    struct llambda* lambda; /* LVAL_FUN, when it isn't a builtin */
+
+    /* LVAL_BIG, always out of long range; see lbig */
+    struct {
+      int size;
+      int sign;
+      uint32_t* digits;
+    };
+
+    /*
+     * LVAL_SEXPR and LVAL_QEXPR are a view of count cells of an lcells,
+     * LVAL_VEC a view of count numbers of an lvec
+     */
+    struct {
+      int count;
+      int front;
+      union {
+        struct lval** cell;
+        long* nums;
+        double* reals;
+      };
+    };
+
+    struct lval* next_free; /* a dead cell on the pool's free list */
+  };
+};
 
+/*
+ * The buffer behind a list's cells. A list value is a view of count slots
+ * starting at items[front], and any number of views can share a buffer:
+ * the buffer holds the references for items[lo..hi) and the views hold
+ * references to the buffer. Slots outside [lo, hi) belong to nobody, so a
+ * view that ends at hi can append in place and one that starts at lo can
+ * prepend in place, even when the buffer is shared. Nothing else is ever
+ * written, which is what makes tail, cons and join persistent and cheap.
+ */
+typedef struct {
+  int refs;
+  int capacity;
+  int lo;
+  int hi;
+  int gc_state; /* see lgc_collect */
+  lval* items[];
+} lcells;
+
+/*
+ * The packed numbers behind a vector, either all longs or all doubles.
+ * Vectors are never written after they are built, so slices are just
+ * narrower views of the same buffer. narrow records that every long fits
+ * in 32 bits, which vdot can use.
+ */
+typedef struct {
+  int refs;
   int count;
-  struct lval** cell;
-};
+  long gc_epoch; /* the last collection that counted it as live */
+  int narrow;
+  int reals;     /* items holds doubles, see lvec_reals */
+  long items[];
+} lvec;
+
+/* an open-addressing hash table keyed by interned symbol */
+typedef struct {
+  char* sym; /* interned, so compared by pointer; NULL if the slot is free */
+  unsigned long hash;
+  lval* val;
+} lentry;
 
 struct lenv {
   int count;
-  char** syms;
-  lval** vals;
+  int capacity;
+  lentry* entries;
+  unsigned long version; /* changes whenever an entry is added or moved */
 };
 
+/*
+ * The names a lambda's body can see: first its formals, which are the
+ * slots of each frame it is called with, and then the free variables it
+ * captured when it was made.
+ */
+typedef struct lscope {
+  int count;
+  int locals;   /* how many of the names are formals */
+  char** names; /* interned */
+} lscope;
+
+/*
+ * The locals of one call, as a flat array in the slot order of its lscope.
+ * A frame holds a reference to each value in it and to the lambda being
+ * called, whose captured values free points at.
+ */
+typedef struct lframe {
+  int refs;
+  int count;
+  lval* fn;
+  lval** free;
+  lval* slots[];
+} lframe;
+
+/*
+ * A function made by '\'. formals is a Q-expression of symbols, where
+ * '& rest' collects any further arguments into a list, and body is the
+ * Q-expression to evaluate with them bound. Lambdas are shared by every
+ * copy of their value, like list buffers. The functions memo makes are
+ * lambdas too, with no formals or body but a table of results.
+ */
+typedef struct llambda {
+  int refs;
+  lval* formals;
+  lval* body;
+  int variadic;
+  lscope scope;         /* the formals, then the free variables */
+  lval** captured;      /* a value for each free variable, in scope order */
+  struct lchunk* chunk; /* compiled on the first call, see llambda_code */
+  struct lmemo* memo;   /* only for memo's functions, see lmemo_call */
+} llambda;
+
+
+// Tagged Values
+
+/*
+ * An lval* is not always a pointer. Heap values are at least 8-byte
+ * aligned, and so are interned symbol names, which frees up the low bits
+ * to carry small values directly:
+ *
+ *   ...xxx1  a fixnum, the long value shifted left by one
+ *   ...x010  a builtin, as an index into the builtins table
+ *   ...x100  a flonum, a double with its exponent squeezed (see below)
+ *   ...x110  a symbol, as its interned name with the tag or'd in
+ *   ...x000  a pointer to a heap lval
+ *
+ * Immediates need no allocation and no reference counting, so arithmetic
+ * never touches the heap unless a result outgrows a fixnum or a flonum,
+ * and a list of numbers or symbols costs one word per element. Always go
+ * through lval_type_of, lval_num_of, lval_dbl_of, lval_fun_of and
+ * lval_sym_of rather than reading the fields of an lval* that might be
+ * immediate.
+ *
+ * A flonum is a double whose exponent is in [-126, 128], or a zero. The
+ * bits are rotated so the sign comes last, the exponent is rebased to fit
+ * in eight bits, and the result moves up over the tag, so every bit of
+ * the mantissa survives. Anything smaller, larger, infinite or NaN is
+ * boxed as a heap LVAL_DBL instead.
+ */
+
+#define LVAL_TAG_MASK 7
+#define LVAL_FIXNUM_TAG 1
+#define LVAL_BUILTIN_TAG 2
+#define LVAL_FLONUM_TAG 4
+#define LVAL_SYM_TAG 6
+
+/* the exponent field of a flonum, rotated up by one, less 896 */
+#define LVAL_FLONUM_BIAS (896UL << 53)
+
+#define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+#define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
+
+struct {
+  int count;
+  lbuiltin* funs;
+} builtins;
+
+int lval_is_immediate(lval* val) {
+  return ((uintptr_t)val & LVAL_TAG_MASK) != 0;
+}
+
+int lval_is_fixnum(lval* val) {
+  return ((uintptr_t)val & LVAL_FIXNUM_TAG) != 0;
+}
+
+int lval_is_builtin(lval* val) {
+  return ((uintptr_t)val & LVAL_TAG_MASK) == LVAL_BUILTIN_TAG;
+}
+
+int lval_is_sym(lval* val) {
+  return ((uintptr_t)val & LVAL_TAG_MASK) == LVAL_SYM_TAG;
+}
+
+int lval_is_flonum(lval* val) {
+  return ((uintptr_t)val & LVAL_TAG_MASK) == LVAL_FLONUM_TAG;
+}
+
+/* a function made by '\', which unlike a builtin lives on the heap */
+int lval_is_lambda(lval* val) {
+  return !lval_is_immediate(val) && val->type == LVAL_FUN;
+}
+
+/* a function made by memo, which lval_call has to apply */
+int lval_is_memo(lval* val) {
+  return lval_is_lambda(val) && val->lambda->memo;
+}
+
+lval* lval_fixnum(long x) {
+  return (lval*)(((uintptr_t)x << 1) | LVAL_FIXNUM_TAG);
+}
+
+/* NULL when x is out of flonum range */
+lval* lval_flonum(double x) {
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+
+  uint64_t rotated = (bits << 1) | (bits >> 63);
+  if (rotated > 1) {
+    unsigned exponent = (bits >> 52) & 0x7ff;
+    if (exponent <= 896 || exponent > 1151) { return NULL; }
+    rotated -= LVAL_FLONUM_BIAS;
+  }
+
+  return (lval*)((rotated << 3) | LVAL_FLONUM_TAG);
+}
+
+lval_type lval_type_of(lval* val) {
+  if (lval_is_fixnum(val)) { return LVAL_NUM; }
+  if (lval_is_builtin(val)) { return LVAL_FUN; }
+  if (lval_is_sym(val)) { return LVAL_SYM; }
+  if (lval_is_flonum(val)) { return LVAL_DBL; }
+  return val->type;
+}
+
+long lval_num_of(lval* val) {
+  return lval_is_fixnum(val) ? (long)((intptr_t)val >> 1) : val->num;
+}
+
+double lval_dbl_of(lval* val) {
+  if (!lval_is_flonum(val)) { return val->dbl; }
+
+  uint64_t rotated = (uintptr_t)val >> 3;
+  if (rotated > 1) { rotated += LVAL_FLONUM_BIAS; }
+  uint64_t bits = (rotated >> 1) | (rotated << 63);
+
+  double x;
+  memcpy(&x, &bits, sizeof(x));
+  return x;
+}
+
+lbuiltin lval_fun_of(lval* val) {
+  return builtins.funs[(uintptr_t)val >> 3];
+}
+
+/* the interned name */
+char* lval_sym_of(lval* val) {
+  return (char*)((uintptr_t)val & ~(uintptr_t)LVAL_TAG_MASK);
+}
+
+// Symbols
+
+/*
+ * Every symbol name is interned once, so an lval's sym points into this
+ * table and two symbols are the same exactly when their pointers are.
+ * Interned names live for the whole process.
+ */
+struct {
+  int count;
+  int capacity;
+  char** names;
+} symtab;
+
+unsigned long lsym_hash(char* name) {
+  /* FNV-1a */
+  unsigned long hash = 14695981039346656037UL;
+  for (char* c = name; *c; c++) {
+    hash ^= (unsigned char)*c;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+void lsym_grow(void) {
+  int old_capacity = symtab.capacity;
+  char** old_names = symtab.names;
+
+  symtab.capacity = old_capacity ? old_capacity * 2 : 256;
+  symtab.names = calloc(symtab.capacity, sizeof(char*));
+
+  for (int i = 0; i < old_capacity; i++) {
+    if (!old_names[i]) { continue; }
+    unsigned long j = lsym_hash(old_names[i]) & (symtab.capacity - 1);
+    while (symtab.names[j]) { j = (j + 1) & (symtab.capacity - 1); }
+    symtab.names[j] = old_names[i];
+  }
+
+  free(old_names);
+}
+
+char* lsym_intern(char* name) {
+  if (symtab.count * 2 >= symtab.capacity) { lsym_grow(); }
+
+  unsigned long i = lsym_hash(name) & (symtab.capacity - 1);
+  while (symtab.names[i]) {
+    if (strcmp(symtab.names[i], name) == 0) { return symtab.names[i]; }
+    i = (i + 1) & (symtab.capacity - 1);
+  }
+
+  symtab.names[i] = malloc(strlen(name) + 1);
+  strcpy(symtab.names[i], name);
+  symtab.count++;
+  return symtab.names[i];
+}
+
+/* the symbols both evaluators treat specially, see lval_eval */
+struct {
+  char* lambda; /* \ */
+  char* cond;   /* if */
+  char* rest;   /* &, in a lambda's formals */
+  char* define; /* def, which only --compile looks for */
+} keywords;
+
+void lsym_init_keywords(void) {
+  keywords.lambda = lsym_intern("\\");
+  keywords.cond = lsym_intern("if");
+  keywords.rest = lsym_intern("&");
+  keywords.define = lsym_intern("def");
+}
+
+/* val is the symbol keyword */
+int lval_is_keyword(lval* val, char* keyword) {
+  return lval_is_sym(val) && lval_sym_of(val) == keyword;
+}
+
+
+// Heap
+
+/*
+ * Reference counting frees almost everything promptly. The collector
+ * finds what counting can't, i.e. values that are only reachable from
+ * each other, by walking every cell of the nursery and the pool. lgc_poll
+ * runs a collection once enough has been allocated; it is only called at
+ * safe points, where every lval in use is fully initialised and every
+ * pointer to one is counted.
+ */
+struct {
+  long count;
+
+  int env_count;
+  lenv** envs;
+
+  long allocated;  /* allocations since the last collection */
+  long threshold;  /* set with --gc-threshold */
+  int verbose;     /* set with --gc-stats */
+
+  long collections;
+  double total_pause;
+} heap = { .threshold = 100000 };
+
+void lgc_poll(void);
+lcells* lval_cells(lval* val);
+void lcells_release(lcells* cells);
+lvec* lval_vec_of(lval* val);
+void lvec_release(lvec* vec);
+
+/*
+ * A stack of pointers on the heap. Walks over nested values push onto
+ * one instead of recursing, so how deeply a value can nest isn't limited
+ * by the C stack.
+ */
+typedef struct {
+  int count;
+  int capacity;
+  void** items;
+} lstack;
+
+void lstack_push(lstack* stack, void* item) {
+  if (stack->count == stack->capacity) {
+    stack->capacity = stack->capacity ? stack->capacity * 2 : 64;
+    stack->items = realloc(stack->items, sizeof(void*) * stack->capacity);
+  }
+  stack->items[stack->count++] = item;
+}
+
+void* lstack_pop(lstack* stack) {
+  return stack->items[--stack->count];
+}
+
+
+// Nursery
+
+/*
+ * Young values are bump-allocated out of aligned blocks. A block only
+ * counts how many of its values are still alive, and once that reaches
+ * zero the whole block is reused. The values that outlive the form that
+ * made them are the ones bound with def, so lenv_put promotes them into
+ * the old space (the slab pool below) and everything else is expected to
+ * die young. Since shared values are immutable, promotion is just a copy.
+ *
+ * The pool recycles freed cells just as cheaply, and bench_alloc shows
+ * no gain from bump allocation, so new values only start out here with
+ * --nursery.
+ */
+
+#define NURSERY_BLOCK_SIZE (256 * 1024)
+#define NURSERY_FREE_BLOCKS 4
+
+typedef struct lblock {
+  struct lblock* prev; /* in use, or on the free list (next only) */
+  struct lblock* next;
+  char* end;           /* where allocation stopped, once retired */
+  long live;
+  int retired;         /* full, and waiting for its last value to die */
+} lblock;
+
+struct {
+  int enabled;  /* set with --nursery */
+  lblock* current;
+  char* top;
+  char* limit;
+
+  lblock* used; /* retired blocks that still have live values */
+  lblock* free;
+  int free_count;
+
+  long blocks;
+  long promoted;
+} nursery = { .enabled = 0 };
+
+lblock* lblock_of(lval* val) {
+  return (lblock*)((uintptr_t)val & ~(uintptr_t)(NURSERY_BLOCK_SIZE - 1));
+}
+
+/* the first value in a block goes just past its (16-byte aligned) header */
+char* lblock_start(lblock* block) {
+  return (char*)block + ((sizeof(lblock) + 15) & ~(size_t)15);
+}
+
+char* lblock_end(lblock* block) {
+  return block == nursery.current ? nursery.top : block->end;
+}
+
+void lnursery_refill(void) {
+  lblock* block = nursery.current;
+
+  /* a full block whose values have all died can just be started over */
+  if (!block || block->live > 0) {
+    if (block) {
+      block->retired = 1;
+      block->end = nursery.top;
+      block->prev = NULL;
+      block->next = nursery.used;
+      if (nursery.used) { nursery.used->prev = block; }
+      nursery.used = block;
+    }
+
+    if (nursery.free) {
+      block = nursery.free;
+      nursery.free = block->next;
+      nursery.free_count--;
+    } else {
+      void* mem;
+      if (posix_memalign(&mem, NURSERY_BLOCK_SIZE, NURSERY_BLOCK_SIZE) != 0) {
+        fputs("out of memory\n", stderr);
+        exit(1);
+      }
+      block = mem;
+      nursery.blocks++;
+    }
+
+    block->live = 0;
+    block->retired = 0;
+    nursery.current = block;
+  }
+
+  nursery.top = lblock_start(block);
+  nursery.limit = (char*)block + NURSERY_BLOCK_SIZE;
+}
+
+lval* lnursery_alloc(void) {
+  if (nursery.top + sizeof(lval) > nursery.limit) { lnursery_refill(); }
+
+  lval* val = (lval*)nursery.top;
+  nursery.top += sizeof(lval);
+  nursery.current->live++;
+  return val;
+}
+
+void lnursery_release(lval* val) {
+  lblock* block = lblock_of(val);
+  if (--block->live > 0) { return; }
+
+  if (block == nursery.current) {
+    nursery.top = lblock_start(block);
+    return;
+  }
+
+  if (block->prev) { block->prev->next = block->next; }
+  else { nursery.used = block->next; }
+  if (block->next) { block->next->prev = block->prev; }
+
+  if (nursery.free_count < NURSERY_FREE_BLOCKS) {
+    block->next = nursery.free;
+    nursery.free = block;
+    nursery.free_count++;
+  } else {
+    free(block);
+    nursery.blocks--;
+  }
+}
+
+
+// Pool
+
+/*
+ * Old values live in page-sized slabs of lval cells. Freed cells go on a
+ * free list threaded through the cells themselves and are handed out again
+ * before any new page is carved up; pages are kept for the life of the
+ * interpreter.
+ */
+
+#define POOL_PAGE_SIZE 4096
+
+typedef struct lpage {
+  struct lpage* next;
+  lval* end; /* where carving stopped, once the page is full */
+} lpage;
+
+typedef struct {
+  lpage* pages;
+  lval* top;   /* the uncarved part of the newest page */
+  lval* limit;
+  lval* free;
+
+  long page_count;
+  long live;
+  long allocs;
+  long reused;
+} lpool;
+
+lpool pool;
+
+lval* lpage_start(lpage* page) {
+  return (lval*)(page + 1);
+}
+
+lval* lpage_end(lpool* p, lpage* page) {
+  return page == p->pages ? p->top : page->end;
+}
+
+lval* lpool_alloc(lpool* p) {
+  p->allocs++;
+  p->live++;
+
+  if (p->free) {
+    lval* cell = p->free;
+    p->free = cell->next_free;
+    p->reused++;
+    return cell;
+  }
+
+  if (p->top == p->limit) {
+    if (p->pages) { p->pages->end = p->top; }
+
+    lpage* page = malloc(POOL_PAGE_SIZE);
+    page->next = p->pages;
+    p->pages = page;
+    p->page_count++;
+
+    p->top = lpage_start(page);
+    p->limit = p->top + (POOL_PAGE_SIZE - sizeof(lpage)) / sizeof(lval);
+  }
+
+  return p->top++;
+}
+
+void lpool_free(lpool* p, lval* val) {
+  val->next_free = p->free;
+  p->free = val;
+  p->live--;
+}
+
+double lpool_reuse_rate(lpool* p) {
+  return p->allocs ? (double)p->reused / p->allocs : 0;
+}
+
+lval* lval_alloc(int young) {
+  lval* val = young ? lnursery_alloc() : lpool_alloc(&pool);
+  val->young = young;
+  return val;
+}
+
+lval* lval_init(lval* val, lval_type type) {
+  val->type = type;
+  val->refs = 1;
+  val->marked = 0;
+  val->dead = 0;
+
+  heap.count++;
+  heap.allocated++;
+
+  return val;
+}
+
+lval* lval_new(lval_type type) {
+  return lval_init(lval_alloc(nursery.enabled), type);
+}
+
+void llambda_release(llambda* lambda);
+
+/* release a heap value's storage without touching its children or cells */
+void lval_free(lval* val) {
+  heap.count--;
+
+  switch (val->type) {
+    case LVAL_ERR: free(val->err); break;
+    case LVAL_BIG: free(val->digits); break;
+    case LVAL_FUN: llambda_release(val->lambda); break;
+    default: break;
+  }
+
+  /* dead cells stay put until reused, and the collector skips them */
+  val->dead = 1;
+
+  if (val->young) {
+    lnursery_release(val);
+  } else {
+    lpool_free(&pool, val);
+  }
+}
+
 
 // Constructors
 
 lval* lval_num(long x) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_NUM;
+  if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+    return lval_fixnum(x);
+  }
+
+  lval* val = lval_new(LVAL_NUM);
   val->num = x;
   return val;
 }
 
+lval* lval_dbl(double x) {
+  lval* flonum = lval_flonum(x);
+  if (flonum) { return flonum; }
+
+  lval* val = lval_new(LVAL_DBL);
+  val->dbl = x;
+  return val;
+}
+
 lval* lval_err(char* fmt, ...) {
-  lval* val = malloc(sizeof(val));
-  val->type = LVAL_ERR;
+  lval* val = lval_new(LVAL_ERR);
 
   va_list args;
   va_start(args, fmt);
@@ -75,107 +730,342 @@ char* ltype_name(int t) {
   switch (t) {
     case LVAL_FUN: return "Function";
     case LVAL_NUM: return "Number";
+    case LVAL_BIG: return "Number";
+    case LVAL_DBL: return "Number";
     case LVAL_ERR: return "Error";
     case LVAL_SYM: return "Symbol";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_VEC: return "Vector";
     default: return "Unknown";
   }
 }
 
 lval* lval_sym(char* sym) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_SYM;
-  val->sym = malloc(strlen(sym) + 1);
-  strcpy(val->sym, sym);
-  return val;
+  return (lval*)((uintptr_t)lsym_intern(sym) | LVAL_SYM_TAG);
 }
 
 lval* lval_fun(lbuiltin func) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_FUN;
-  val->fun = func;
-  return val;
+  int i = 0;
+  while (i < builtins.count && builtins.funs[i] != func) { i++; }
+
+  if (i == builtins.count) {
+    builtins.count++;
+    builtins.funs = realloc(builtins.funs, sizeof(lbuiltin) * builtins.count);
+    builtins.funs[i] = func;
+  }
+
+  return (lval*)(((uintptr_t)i << 3) | LVAL_BUILTIN_TAG);
 }
 
 lval* lval_sexpr(void) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_SEXPR;
+  lval* val = lval_new(LVAL_SEXPR);
   val->count = 0;
+  val->front = 0;
   val->cell = NULL;
   return val;
 }
 
 lval* lval_qexpr(void) {
-  lval* val = malloc(sizeof(lval));
-  val->type = LVAL_QEXPR;
+  lval* val = lval_new(LVAL_QEXPR);
   val->count = 0;
+  val->front = 0;
   val->cell = NULL;
   return val;
 }
 
+/* a lambda that captures nothing yet; consumes formals and body, which
+   must already be checked, see lval_close */
+lval* lval_lambda(lval* formals, lval* body) {
+  llambda* lambda = malloc(sizeof(llambda));
+  lambda->refs = 1;
+  lambda->formals = formals;
+  lambda->body = body;
+  lambda->variadic = 0;
+  lambda->captured = NULL;
+  lambda->chunk = NULL;
+  lambda->memo = NULL;
+
+  lambda->scope.count = 0;
+  lambda->scope.names = malloc(sizeof(char*) * (formals->count + 1));
+  for (int i = 0; i < formals->count; i++) {
+    if (lval_is_keyword(formals->cell[i], keywords.rest)) {
+      lambda->variadic = 1;
+      continue;
+    }
+    lambda->scope.names[lambda->scope.count++] = lval_sym_of(formals->cell[i]);
+  }
+  lambda->scope.locals = lambda->scope.count;
+
+  lval* val = lval_new(LVAL_FUN);
+  val->lambda = lambda;
+  return val;
+}
+
+/* a view of count numbers from items[front]; takes over one reference */
+lval* lval_vec(lvec* vec, int front, int count) {
+  lval* val = lval_new(LVAL_VEC);
+  val->count = count;
+  val->front = front;
+  val->nums = vec->items + front;
+  return val;
+}
+
+/* versions are unique across environments, so a freed and reallocated
+   lenv can never match a cache that was filled for its predecessor */
+unsigned long lenv_versions = 0;
+
 lenv* lenv_new(void) {
   lenv* env = malloc(sizeof(lenv));
   env->count = 0;
-  env->syms = NULL;
-  env->vals = NULL;
+  env->capacity = 0;
+  env->entries = NULL;
+  env->version = ++lenv_versions;
+
+  heap.env_count++;
+  heap.envs = realloc(heap.envs, sizeof(lenv*) * heap.env_count);
+  heap.envs[heap.env_count - 1] = env;
+
   return env;
 }
 
 
 // Destructors
 
-void lval_del(lval* val) {
-  switch (val->type) {
-    case LVAL_NUM: break;
-    case LVAL_FUN: break;
+/* values whose last reference is gone, waiting to release their cells */
+struct {
+  lstack pending;
+  int draining;
+} ldel;
 
-    case LVAL_ERR: free(val->err); break;
-    case LVAL_SYM: free(val->sym); break;
+/* frees val, whose last reference is gone, releasing what it holds */
+void lval_release(lval* val) {
+  if ((val->type == LVAL_SEXPR || val->type == LVAL_QEXPR) && val->cell) {
+    lcells_release(lval_cells(val));
+  }
+  if (val->type == LVAL_VEC) {
+    lvec_release(lval_vec_of(val));
+  }
 
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-      for (int i = 0; i < val->count; i++) {
-        lval_del(val->cell[i]);
-      }
-      free(val->cell);
-      break;
+  lval_free(val);
+}
+
+/*
+ * Releases one reference; the value itself goes with the last one.
+ * Freeing a list releases its cells, which may be lists themselves, so
+ * instead of recursing as deep as they nest, the outermost lval_del
+ * frees values off a stack until nothing is left.
+ */
+void lval_del(lval* val) {
+  if (lval_is_immediate(val)) { return; }
+  if (--val->refs > 0) { return; }
+
+  if (ldel.draining) {
+    int holds = val->type == LVAL_FUN
+      || ((val->type == LVAL_SEXPR || val->type == LVAL_QEXPR) && val->cell);
+    if (holds) {
+      lstack_push(&ldel.pending, val);
+    } else {
+      lval_release(val);
+    }
+    return;
   }
 
-  free(val);
+  ldel.draining = 1;
+  lval_release(val);
+  while (ldel.pending.count > 0) {
+    lval_release(lstack_pop(&ldel.pending));
+  }
+  ldel.draining = 0;
 }
 
 void lenv_del(lenv* env) {
-  for (int i = 0; i < env->count; i++) {
-    free(env->syms[i]);
-    lval_del(env->vals[i]);
+  for (int i = 0; i < env->capacity; i++) {
+    if (env->entries[i].sym) { lval_del(env->entries[i].val); }
+  }
+
+  for (int i = 0; i < heap.env_count; i++) {
+    if (heap.envs[i] == env) {
+      heap.envs[i] = heap.envs[--heap.env_count];
+      break;
+    }
   }
 
-  free(env->syms);
-  free(env->vals);
+  free(env->entries);
   free(env);
 }
 
 
 // Utilities
 
+lval* lval_ref(lval* val) {
+  if (!lval_is_immediate(val)) { val->refs++; }
+  return val;
+}
+
+void lchunk_del(struct lchunk* chunk);
+void lmemo_del(struct lmemo* memo);
+
+void llambda_release(llambda* lambda) {
+  if (--lambda->refs > 0) { return; }
+
+  lval_del(lambda->formals);
+  lval_del(lambda->body);
+  for (int i = 0; i < lambda->scope.count - lambda->scope.locals; i++) {
+    lval_del(lambda->captured[i]);
+  }
+  free(lambda->captured);
+  if (lambda->chunk) { lchunk_del(lambda->chunk); }
+  if (lambda->memo) { lmemo_del(lambda->memo); }
+  free(lambda->scope.names);
+  free(lambda);
+}
+
+/* a buffer with room for capacity cells, the first of which goes at lo */
+lcells* lcells_new(int capacity, int lo) {
+  lcells* cells = malloc(sizeof(lcells) + sizeof(lval*) * capacity);
+  cells->refs = 1;
+  cells->capacity = capacity;
+  cells->lo = lo;
+  cells->hi = lo;
+  cells->gc_state = 0;
+  return cells;
+}
+
+void lcells_release(lcells* cells) {
+  if (--cells->refs > 0) { return; }
+
+  for (int i = cells->lo; i < cells->hi; i++) {
+    lval_del(cells->items[i]);
+  }
+  free(cells);
+}
+
+size_t lcells_bytes(lcells* cells) {
+  return sizeof(lcells) + sizeof(lval*) * cells->capacity;
+}
+
+lcells* lval_cells(lval* val) {
+  if (!val->cell) { return NULL; }
+  return (lcells*)((char*)(val->cell - val->front) - offsetof(lcells, items));
+}
+
+void lval_set_cells(lval* val, lcells* cells, int front, int count) {
+  val->cell = cells->items + front;
+  val->front = front;
+  val->count = count;
+}
+
+/* room for count numbers; call lvec_seal once they are filled in */
+lvec* lvec_new(int count, int reals) {
+  lvec* vec = malloc(sizeof(lvec) + sizeof(long) * count);
+  vec->refs = 1;
+  vec->count = count;
+  vec->gc_epoch = 0;
+  vec->narrow = 0;
+  vec->reals = reals;
+  return vec;
+}
+
+/* a buffer only ever holds one kind of number, so this never aliases */
+double* lvec_reals(lvec* vec) {
+  return (double*)vec->items;
+}
+
+lvec* lvec_seal(lvec* vec) {
+  if (vec->reals) { return vec; }
+
+  vec->narrow = 1;
+  for (int i = 0; i < vec->count; i++) {
+    long x = vec->items[i];
+    vec->narrow &= x >= INT32_MIN && x <= INT32_MAX;
+  }
+  return vec;
+}
+
+void lvec_release(lvec* vec) {
+  if (--vec->refs == 0) { free(vec); }
+}
+
+size_t lvec_bytes(lvec* vec) {
+  return sizeof(lvec) + sizeof(long) * vec->count;
+}
+
+lvec* lval_vec_of(lval* val) {
+  return (lvec*)((char*)(val->nums - val->front) - offsetof(lvec, items));
+}
+
+/* copy val's cells into a buffer of its own, with room at either end */
+void lval_copy_cells(lval* val, int capacity, int front) {
+  lcells* old = lval_cells(val);
+  lcells* cells = lcells_new(capacity, front);
+
+  for (int i = 0; i < val->count; i++) {
+    cells->items[cells->hi++] = lval_ref(val->cell[i]);
+  }
+
+  lval_set_cells(val, cells, front, val->count);
+  if (old) { lcells_release(old); }
+}
+
+/* make room to append up to n cells in total; val must be unshared */
+void lval_reserve(lval* val, int n) {
+  lcells* cells = lval_cells(val);
+  if (cells && val->front + val->count == cells->hi
+      && val->front + n <= cells->capacity) {
+    return;
+  }
+
+  int capacity = val->count * 2;
+  if (capacity < n) { capacity = n; }
+  lval_copy_cells(val, capacity, 0);
+}
+
 lval* lval_add(lval* val, lval* child) {
+  lval_reserve(val, val->count + 1);
+  lcells* cells = lval_cells(val);
+  cells->items[cells->hi++] = child;
   val->count++;
-  val->cell = realloc(val->cell, sizeof(lval*) * val->count);
-  val->cell[val->count - 1] = child;
   return val;
 }
 
 /* pop the ith expr from an lval; both must be freed later */
 lval* lval_pop(lval* val, int i) {
+  lcells* cells = lval_cells(val);
   lval* result = val->cell[i];
+
+  /* the ends just narrow the view, taking the buffer's reference if we can */
+  if (i == 0 || i == val->count - 1) {
+    int owned = cells->refs == 1;
+
+    if (i == 0) {
+      owned = owned && val->front == cells->lo;
+      if (owned) { cells->lo++; }
+      val->cell++;
+      val->front++;
+    } else {
+      owned = owned && val->front + val->count == cells->hi;
+      if (owned) { cells->hi--; }
+    }
+
+    val->count--;
+    return owned ? result : lval_ref(result);
+  }
+
+  if (cells->refs > 1 || val->front != cells->lo
+      || val->front + val->count != cells->hi) {
+    /* the copy's reference to result is the one we hand back */
+    lval_copy_cells(val, val->count, 0);
+    cells = lval_cells(val);
+  }
+
   memmove(
     &val->cell[i],
     &val->cell[i + 1],
     sizeof(lval*) * (val->count - i - 1)
   );
   val->count--;
-  val->cell = realloc(val->cell, sizeof(lval*) * val->count);
+  cells->hi--;
   return result;
 }
 
@@ -186,365 +1076,6020 @@ lval* lval_take(lval* val, int i) {
   return result;
 }
 
-lval* lval_copy(lval* val) {
-  lval* result = malloc(sizeof(lval));
-  result->type = val->type;
+/* returns a value equal to val that is safe to mutate; consumes val */
+lval* lval_unshare(lval* val) {
+  if (lval_is_immediate(val) || val->refs == 1) { return val; }
+
+  lval* result = lval_new(val->type);
 
   switch (val->type) {
-    case LVAL_FUN: result->fun = val->fun; break;
+    case LVAL_SYM: break; /* symbols are always immediate */
+    case LVAL_FUN:
+      result->lambda = val->lambda;
+      val->lambda->refs++;
+      break;
     case LVAL_NUM: result->num = val->num; break;
+    case LVAL_DBL: result->dbl = val->dbl; break;
 
     case LVAL_ERR:
       result->err = malloc(strlen(val->err) + 1);
       strcpy(result->err, val->err);
       break;
-    case LVAL_SYM:
-      result->sym = malloc(strlen(val->err) + 1);
-      strcpy(result->sym, val->sym);
+
+    case LVAL_BIG:
+      result->size = val->size;
+      result->sign = val->sign;
+      result->digits = malloc(sizeof(uint32_t) * val->size);
+      memcpy(result->digits, val->digits, sizeof(uint32_t) * val->size);
       break;
 
+    /* a new view of the same cells, which views never write over */
     case LVAL_SEXPR:
     case LVAL_QEXPR:
-      result->count = val->count;
-      result->cell = malloc(sizeof(lval*) * result->count);
-      for (int i = 0; i < val->count; i++) {
-        result->cell[i] = lval_copy(val->cell[i]);
+      result->count = 0;
+      result->front = 0;
+      result->cell = NULL;
+      if (val->cell) {
+        lcells* cells = lval_cells(val);
+        cells->refs++;
+        lval_set_cells(result, cells, val->front, val->count);
       }
       break;
+    case LVAL_VEC:
+      lval_vec_of(val)->refs++;
+      result->count = val->count;
+      result->front = val->front;
+      result->nums = val->nums;
+      break;
   }
 
+  lval_del(val);
   return result;
 }
 
-lval* lenv_get(lenv* env, lval* key) {
-  for (int i = 0; i < env->count; i++) {
-    if (strcmp(env->syms[i], key->sym) == 0) {
-      return lval_copy(env->vals[i]);
-    }
-  }
+/* an S-expression of the cells of the Q-expression val, which it borrows */
+lval* lval_unquote(lval* val) {
+  lval* result = lval_unshare(lval_ref(val));
+  result->type = LVAL_SEXPR;
+  return result;
+}
+
+/* symbols are interned, so their address is as good as their name */
+unsigned long lenv_hash(char* sym) {
+  unsigned long hash = (unsigned long)sym;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdUL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/* the entry for sym, or the free slot where it would go */
+lentry* lenv_find(lenv* env, char* sym, unsigned long hash) {
+  unsigned long mask = env->capacity - 1;
+  unsigned long i = hash & mask;
+
+  while (env->entries[i].sym && env->entries[i].sym != sym) {
+    i = (i + 1) & mask;
+  }
+
+  return &env->entries[i];
+}
+
+void lenv_grow(lenv* env) {
+  int old_capacity = env->capacity;
+  lentry* old_entries = env->entries;
+
+  env->capacity = old_capacity ? old_capacity * 2 : 16;
+  env->entries = calloc(env->capacity, sizeof(lentry));
+
+  for (int i = 0; i < old_capacity; i++) {
+    if (!old_entries[i].sym) { continue; }
+    *lenv_find(env, old_entries[i].sym, old_entries[i].hash) = old_entries[i];
+  }
+
+  free(old_entries);
+  env->version = ++lenv_versions;
+}
+
+/* an old-space copy of val alone; a list's cells go on pending */
+lval* lval_promote_one(lval* val, lstack* pending) {
+  if (lval_is_immediate(val) || !val->young) { return val; }
+
+  lval* result = lval_init(lval_alloc(0), val->type);
+  nursery.promoted++;
+
+  switch (val->type) {
+    case LVAL_SYM: break; /* symbols are always immediate */
+    case LVAL_FUN:
+      result->lambda = val->lambda;
+      val->lambda->refs++;
+      break;
+    case LVAL_NUM: result->num = val->num; break;
+    case LVAL_DBL: result->dbl = val->dbl; break;
+
+    case LVAL_ERR:
+      result->err = malloc(strlen(val->err) + 1);
+      strcpy(result->err, val->err);
+      break;
+
+    case LVAL_BIG:
+      result->size = val->size;
+      result->sign = val->sign;
+      result->digits = malloc(sizeof(uint32_t) * val->size);
+      memcpy(result->digits, val->digits, sizeof(uint32_t) * val->size);
+      break;
+
+    /*
+     * swapping the cells for promoted copies is invisible to other views
+     * of the buffer, since the copies are equal and nobody mutates them
+     */
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      result->count = 0;
+      result->front = 0;
+      result->cell = NULL;
+      if (val->cell) {
+        lcells* cells = lval_cells(val);
+        cells->refs++;
+        lval_set_cells(result, cells, val->front, val->count);
+        lstack_push(pending, cells);
+      }
+      break;
+    case LVAL_VEC:
+      lval_vec_of(val)->refs++;
+      result->count = val->count;
+      result->front = val->front;
+      result->nums = val->nums;
+      break;
+  }
+
+  lval_del(val);
+  return result;
+}
+
+/* returns an old-space value equal to val; consumes val */
+lval* lval_promote(lval* val) {
+  lstack pending = { 0 };
+  lval* result = lval_promote_one(val, &pending);
+
+  while (pending.count > 0) {
+    lcells* cells = lstack_pop(&pending);
+    for (int i = cells->lo; i < cells->hi; i++) {
+      cells->items[i] = lval_promote_one(cells->items[i], &pending);
+    }
+  }
+
+  free(pending.items);
+  return result;
+}
+
+/* the entry bound to key, or NULL */
+lentry* lenv_entry(lenv* env, lval* key) {
+  if (env->count == 0) { return NULL; }
+
+  char* sym = lval_sym_of(key);
+  lentry* entry = lenv_find(env, sym, lenv_hash(sym));
+  return entry->sym ? entry : NULL;
+}
+
+lval* lenv_get(lenv* env, lval* key) {
+  lentry* entry = lenv_entry(env, key);
+  if (entry) { return lval_ref(entry->val); }
+
+  return lval_err("Unbound symbol: '%s'", lval_sym_of(key));
+}
+
+/*
+ * Rebinding a symbol reuses its entry, so only new symbols and growing
+ * the table change the version: a cached entry stays valid as long as
+ * the version it was cached at, and always holds the current value.
+ */
+void lenv_put(lenv* env, lval* key, lval* val) {
+  /* keep the load factor under 3/4 */
+  if ((env->count + 1) * 4 > env->capacity * 3) { lenv_grow(env); }
+
+  char* sym = lval_sym_of(key);
+  unsigned long hash = lenv_hash(sym);
+  lentry* entry = lenv_find(env, sym, hash);
+
+  if (entry->sym) {
+    lval_del(entry->val);
+    entry->val = lval_promote(lval_ref(val));
+    return;
+  }
+
+  env->count++;
+  env->version = ++lenv_versions;
+  entry->sym = sym;
+  entry->hash = hash;
+  entry->val = lval_promote(lval_ref(val));
+}
+
+
+// Bignums
+
+/*
+ * Integers that don't fit in a long, as a sign and a magnitude of base
+ * 10^9 digits, least significant first. Decimal digits make reading and
+ * printing linear, and a digit times a digit plus two carries still fits
+ * in 64 bits. Arithmetic starts out on longs and only moves here when a
+ * result overflows, and lval_big turns anything that fits back into a
+ * plain number, so an LVAL_BIG is always out of long range.
+ */
+
+#define LBIG_BASE 1000000000U
+#define LBIG_BASE_DIGITS 9
+
+/* at least this many digits on both sides before Karatsuba pays off */
+int lbig_karatsuba_digits = 32;
+
+typedef struct {
+  int size;   /* digits in use; the top one is never zero */
+  int sign;   /* 1 or -1 */
+  uint32_t* digits;
+  uint32_t small[3]; /* enough for any long, see lbig_of */
+} lbig;
+
+int lmag_trim(uint32_t* a, int n) {
+  while (n > 0 && a[n - 1] == 0) { n--; }
+  return n;
+}
+
+int lmag_cmp(uint32_t* a, int na, uint32_t* b, int nb) {
+  if (na != nb) { return na < nb ? -1 : 1; }
+  for (int i = na - 1; i >= 0; i--) {
+    if (a[i] != b[i]) { return a[i] < b[i] ? -1 : 1; }
+  }
+  return 0;
+}
+
+/* out needs room for max(na, nb) + 1 digits; returns the size */
+int lmag_add(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* out) {
+  if (na < nb) {
+    uint32_t* t = a; a = b; b = t;
+    int n = na; na = nb; nb = n;
+  }
+
+  uint32_t carry = 0;
+  for (int i = 0; i < na; i++) {
+    uint32_t sum = a[i] + (i < nb ? b[i] : 0) + carry;
+    carry = sum >= LBIG_BASE;
+    out[i] = carry ? sum - LBIG_BASE : sum;
+  }
+  out[na] = carry;
+
+  return lmag_trim(out, na + 1);
+}
+
+/* a - b into out, which may be a; a must be at least b */
+int lmag_sub(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* out) {
+  uint32_t borrow = 0;
+  for (int i = 0; i < na; i++) {
+    uint32_t sub = (i < nb ? b[i] : 0) + borrow;
+    borrow = a[i] < sub;
+    out[i] = borrow ? a[i] + LBIG_BASE - sub : a[i] - sub;
+  }
+  return lmag_trim(out, na);
+}
+
+/* adds b into a starting at digit shift; a must have room for the result */
+void lmag_add_at(uint32_t* a, int na, uint32_t* b, int nb, int shift) {
+  uint32_t carry = 0;
+  for (int i = 0; i < nb || carry; i++) {
+    if (shift + i >= na) { break; }
+    uint32_t sum = a[shift + i] + (i < nb ? b[i] : 0) + carry;
+    carry = sum >= LBIG_BASE;
+    a[shift + i] = carry ? sum - LBIG_BASE : sum;
+  }
+}
+
+/* out needs na + nb zeroed digits */
+void lmag_mul_school(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* out) {
+  for (int i = 0; i < na; i++) {
+    uint64_t carry = 0;
+    for (int j = 0; j < nb; j++) {
+      uint64_t t = out[i + j] + (uint64_t)a[i] * b[j] + carry;
+      out[i + j] = t % LBIG_BASE;
+      carry = t / LBIG_BASE;
+    }
+    for (int k = i + nb; carry; k++) {
+      uint64_t t = out[k] + carry;
+      out[k] = t % LBIG_BASE;
+      carry = t / LBIG_BASE;
+    }
+  }
+}
+
+/*
+ * out needs na + nb zeroed digits. With a = a1*B^m + a0 and the same for
+ * b, the middle term a0*b1 + a1*b0 is (a0 + a1)(b0 + b1) - a0*b0 - a1*b1,
+ * which trades one of the four half-size products for a few additions.
+ */
+void lmag_mul(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* out) {
+  if (na < nb) {
+    uint32_t* t = a; a = b; b = t;
+    int n = na; na = nb; nb = n;
+  }
+  if (nb < lbig_karatsuba_digits) {
+    lmag_mul_school(a, na, b, nb, out);
+    return;
+  }
+
+  /* lopsided: multiply b by one b-sized slice of a at a time */
+  int m = na / 2;
+  if (nb <= m) {
+    uint32_t* part = malloc(sizeof(uint32_t) * 2 * nb);
+    for (int i = 0; i < na; i += nb) {
+      int len = na - i < nb ? na - i : nb;
+      memset(part, 0, sizeof(uint32_t) * (len + nb));
+      lmag_mul(a + i, len, b, nb, part);
+      lmag_add_at(out, na + nb, part, len + nb, i);
+    }
+    free(part);
+    return;
+  }
+
+  int na0 = lmag_trim(a, m);
+  int nb0 = lmag_trim(b, m);
+  int na1 = na - m;
+  int nb1 = nb - m;
+
+  /* z0 and z2 go straight into place, since they can't overlap */
+  lmag_mul(a, na0, b, nb0, out);
+  lmag_mul(a + m, na1, b + m, nb1, out + 2 * m);
+
+  /* na1 is at least m, so it bounds all four halves */
+  uint32_t* sa = malloc(sizeof(uint32_t) * (na1 + 1));
+  uint32_t* sb = malloc(sizeof(uint32_t) * (na1 + 1));
+  int nsa = lmag_add(a, na0, a + m, na1, sa);
+  int nsb = lmag_add(b, nb0, b + m, nb1, sb);
+
+  int nz1 = nsa + nsb;
+  uint32_t* z1 = calloc(nz1, sizeof(uint32_t));
+  lmag_mul(sa, nsa, sb, nsb, z1);
+  nz1 = lmag_trim(z1, nz1);
+  nz1 = lmag_sub(z1, nz1, out, lmag_trim(out, na0 + nb0), z1);
+  nz1 = lmag_sub(z1, nz1, out + 2 * m, lmag_trim(out + 2 * m, na1 + nb1), z1);
+  lmag_add_at(out, na + nb, z1, nz1, m);
+
+  free(sa);
+  free(sb);
+  free(z1);
+}
+
+/* a / d into out, which may be a; returns the remainder */
+uint32_t lmag_div_digit(uint32_t* a, int na, uint32_t d, uint32_t* out) {
+  uint64_t rem = 0;
+  for (int i = na - 1; i >= 0; i--) {
+    uint64_t t = rem * LBIG_BASE + a[i];
+    out[i] = t / d;
+    rem = t % d;
+  }
+  return rem;
+}
+
+/*
+ * Knuth's algorithm D: out needs na - nb + 1 digits and gets the
+ * truncated quotient. Scaling both sides so b's top digit is at least
+ * half the base keeps each estimated quotient digit at most two too big.
+ */
+void lmag_div(uint32_t* a, int na, uint32_t* b, int nb, uint32_t* out) {
+  memset(out, 0, sizeof(uint32_t) * (na - nb + 1));
+  if (nb == 1) {
+    lmag_div_digit(a, na, b[0], out);
+    return;
+  }
+
+  uint32_t scale = LBIG_BASE / ((uint64_t)b[nb - 1] + 1);
+  uint32_t* u = calloc(na + 1, sizeof(uint32_t));
+  uint32_t* v = calloc(nb, sizeof(uint32_t));
+  lmag_mul_school(a, na, &scale, 1, u);
+  lmag_mul_school(b, nb, &scale, 1, v);
+
+  uint64_t top = v[nb - 1];
+  for (int j = na - nb; j >= 0; j--) {
+    uint64_t num = (uint64_t)u[j + nb] * LBIG_BASE + u[j + nb - 1];
+    uint64_t qhat = num / top;
+    uint64_t rhat = num % top;
+
+    while (qhat >= LBIG_BASE
+           || qhat * v[nb - 2] > rhat * LBIG_BASE + u[j + nb - 2]) {
+      qhat--;
+      rhat += top;
+      if (rhat >= LBIG_BASE) { break; }
+    }
+
+    /* u[j..j+nb] -= qhat * v */
+    uint64_t carry = 0;
+    int64_t borrow = 0;
+    for (int i = 0; i <= nb; i++) {
+      uint64_t p = (i < nb ? qhat * v[i] : 0) + carry;
+      carry = p / LBIG_BASE;
+      int64_t t = (int64_t)u[i + j] - (int64_t)(p % LBIG_BASE) - borrow;
+      borrow = t < 0;
+      u[i + j] = borrow ? t + LBIG_BASE : t;
+    }
+
+    /* qhat was one too big, so add v back */
+    if (borrow) {
+      qhat--;
+      uint32_t c = 0;
+      for (int i = 0; i < nb; i++) {
+        uint32_t sum = u[i + j] + v[i] + c;
+        c = sum >= LBIG_BASE;
+        u[i + j] = c ? sum - LBIG_BASE : sum;
+      }
+      u[j + nb] = (u[j + nb] + c) % LBIG_BASE;
+    }
+
+    out[j] = qhat;
+  }
+
+  free(u);
+  free(v);
+}
+
+lbig lbig_alloc(int size, int sign) {
+  lbig big = { 0, sign, calloc(size ? size : 1, sizeof(uint32_t)), { 0 } };
+  return big;
+}
+
+/* borrows a bignum's digits, or spells a long out in big.small */
+void lbig_of(lval* val, lbig* big) {
+  if (lval_type_of(val) == LVAL_BIG) {
+    big->size = val->size;
+    big->sign = val->sign;
+    big->digits = val->digits;
+    return;
+  }
+
+  long x = lval_num_of(val);
+  unsigned long mag = x < 0 ? -(unsigned long)x : (unsigned long)x;
+  big->sign = x < 0 ? -1 : 1;
+  big->digits = big->small;
+  big->size = 0;
+  while (mag > 0) {
+    big->small[big->size++] = mag % LBIG_BASE;
+    mag /= LBIG_BASE;
+  }
+}
+
+lbig lbig_copy(lbig* a) {
+  lbig big = lbig_alloc(a->size, a->sign);
+  memcpy(big.digits, a->digits, sizeof(uint32_t) * a->size);
+  big.size = a->size;
+  return big;
+}
+
+lbig lbig_add(lbig* a, lbig* b) {
+  int size = (a->size > b->size ? a->size : b->size) + 1;
+
+  if (a->sign == b->sign) {
+    lbig big = lbig_alloc(size, a->sign);
+    big.size = lmag_add(a->digits, a->size, b->digits, b->size, big.digits);
+    return big;
+  }
+
+  /* opposite signs: the smaller magnitude comes off the larger */
+  if (lmag_cmp(a->digits, a->size, b->digits, b->size) < 0) {
+    lbig* t = a; a = b; b = t;
+  }
+  lbig big = lbig_alloc(size, a->sign);
+  big.size = lmag_sub(a->digits, a->size, b->digits, b->size, big.digits);
+  return big;
+}
+
+lbig lbig_neg(lbig* a) {
+  lbig big = lbig_copy(a);
+  big.sign = -a->sign;
+  return big;
+}
+
+lbig lbig_sub(lbig* a, lbig* b) {
+  lbig neg = *b;
+  neg.sign = -b->sign;
+  return lbig_add(a, &neg);
+}
+
+lbig lbig_mul(lbig* a, lbig* b) {
+  lbig big = lbig_alloc(a->size + b->size, a->sign * b->sign);
+  lmag_mul(a->digits, a->size, b->digits, b->size, big.digits);
+  big.size = lmag_trim(big.digits, a->size + b->size);
+  return big;
+}
+
+/* truncates towards zero, like C; b must not be zero */
+lbig lbig_div(lbig* a, lbig* b) {
+  if (lmag_cmp(a->digits, a->size, b->digits, b->size) < 0) {
+    return lbig_alloc(0, 1);
+  }
+
+  lbig big = lbig_alloc(a->size - b->size + 1, a->sign * b->sign);
+  lmag_div(a->digits, a->size, b->digits, b->size, big.digits);
+  big.size = lmag_trim(big.digits, a->size - b->size + 1);
+  return big;
+}
+
+/* -1, 0 or 1 as a is less than, equal to or greater than b */
+int lbig_cmp(lbig* a, lbig* b) {
+  int sa = a->size ? a->sign : 0;
+  int sb = b->size ? b->sign : 0;
+  if (sa != sb) { return sa < sb ? -1 : 1; }
+  return sa * lmag_cmp(a->digits, a->size, b->digits, b->size);
+}
+
+/* the product of xs[lo..hi), multiplied as a balanced tree so the big
+   multiplications happen between operands of similar size */
+lbig lbig_product(lbig* xs, int lo, int hi) {
+  if (hi - lo == 1) { return lbig_copy(&xs[lo]); }
+
+  int mid = lo + (hi - lo) / 2;
+  lbig left = lbig_product(xs, lo, mid);
+  lbig right = lbig_product(xs, mid, hi);
+  lbig big = lbig_mul(&left, &right);
+  free(left.digits);
+  free(right.digits);
+  return big;
+}
+
+/* parses an optionally signed run of decimal digits */
+lbig lbig_parse(char* str) {
+  int sign = 1;
+  if (*str == '-') { sign = -1; str++; }
+  while (*str == '0' && str[1]) { str++; }
+
+  int len = strlen(str);
+  lbig big = lbig_alloc((len + LBIG_BASE_DIGITS - 1) / LBIG_BASE_DIGITS, sign);
+
+  /* nine characters at a time, from the least significant end */
+  for (int end = len; end > 0; end -= LBIG_BASE_DIGITS) {
+    int start = end > LBIG_BASE_DIGITS ? end - LBIG_BASE_DIGITS : 0;
+    uint32_t digit = 0;
+    for (int i = start; i < end; i++) { digit = digit * 10 + (str[i] - '0'); }
+    big.digits[big.size++] = digit;
+  }
+
+  big.size = lmag_trim(big.digits, big.size);
+  return big;
+}
+
+/* a freshly allocated decimal string */
+char* lbig_string(lbig* big) {
+  char* str = malloc((size_t)big->size * LBIG_BASE_DIGITS + 3);
+  char* p = str;
+
+  if (big->size == 0) {
+    strcpy(str, "0");
+    return str;
+  }
+
+  if (big->sign < 0) { *p++ = '-'; }
+  p += sprintf(p, "%u", big->digits[big->size - 1]);
+
+  for (int i = big->size - 2; i >= 0; i--) {
+    uint32_t digit = big->digits[i];
+    for (int k = LBIG_BASE_DIGITS - 1; k >= 0; k--) {
+      p[k] = '0' + digit % 10;
+      digit /= 10;
+    }
+    p += LBIG_BASE_DIGITS;
+  }
+
+  *p = '\0';
+  return str;
+}
+
+/* a number for big, which it takes the digits of */
+lval* lval_big(lbig big) {
+  /* 2^63 is 9 223372036 854775808 */
+  if (big.size <= 3) {
+    unsigned __int128 mag = 0;
+    for (int i = big.size - 1; i >= 0; i--) {
+      mag = mag * LBIG_BASE + big.digits[i];
+    }
+
+    unsigned __int128 limit = (unsigned __int128)LONG_MAX + (big.sign < 0);
+    if (mag <= limit) {
+      free(big.digits);
+      return lval_num(big.sign < 0 ? -(long)(mag - 1) - 1 : (long)mag);
+    }
+  }
+
+  lval* val = lval_new(LVAL_BIG);
+  val->size = big.size;
+  val->sign = big.sign;
+  val->digits = big.digits;
+  return val;
+}
+
+
+// Read
+
+/*
+ * How deeply values and evaluation may nest. Evaluation keeps nested
+ * expressions and calls on heap stacks, so max (set with --max-depth) is
+ * only there to turn runaway recursion into an error before it takes all
+ * of memory. Reading through mpc's parser and code run by builtins like
+ * eval still recurse in C, and nested counts how deep; those stop at the
+ * much smaller LDEPTH_C_MAX.
+ *
+ * Hitting either limit sets exceeded, and evaluation then unwinds all the
+ * way out instead of carrying on from the error like from any other: a
+ * recursion that branches would run into the limit again in every call
+ * it still had pending. The outermost evaluation clears it on return.
+ */
+struct {
+  long max;
+  int nested;
+  int exceeded;
+} ldepth = { .max = 1000000 };
+
+#define LDEPTH_C_MAX 1000
+
+lval* ldepth_err(lval* err) {
+  ldepth.exceeded = 1;
+  return err;
+}
+
+void ldepth_leave(void) {
+  if (--ldepth.nested == 0) { ldepth.exceeded = 0; }
+}
+
+struct {
+  mpc_parser_t* Float;
+  mpc_parser_t* Number;
+  mpc_parser_t* Symbol;
+  mpc_parser_t* SExpr;
+  mpc_parser_t* QExpr;
+  mpc_parser_t* Expr;
+  mpc_parser_t* Lispy;
+} grammar;
+
+void lgrammar_init(void) {
+  grammar.Float = mpc_new("float");
+  grammar.Number = mpc_new("number");
+  grammar.Symbol = mpc_new("symbol");
+  grammar.SExpr = mpc_new("sexpr");
+  grammar.QExpr = mpc_new("qexpr");
+  grammar.Expr = mpc_new("expr");
+  grammar.Lispy = mpc_new("lispy");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    "                                                                   \
+     float  : /-?[0-9]+(\\.[0-9]+([eE][-+]?[0-9]+)?|[eE][-+]?[0-9]+)/ ; \
+     number : /-?[0-9]+/ ;                                              \
+     symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;                        \
+     sexpr  : '(' <expr>* ')' ;                                         \
+     qexpr  : '{' <expr>* '}' ;                                         \
+     expr   : <float> | <number> | <symbol> | <sexpr> | <qexpr> ;       \
+     lispy  : /^/ <expr>* /$/ ;                                         \
+    ",
+    grammar.Float, grammar.Number, grammar.Symbol, grammar.SExpr,
+    grammar.QExpr, grammar.Expr, grammar.Lispy);
+}
+
+void lgrammar_cleanup(void) {
+  mpc_cleanup(7, grammar.Float, grammar.Number, grammar.Symbol, grammar.SExpr,
+              grammar.QExpr, grammar.Expr, grammar.Lispy);
+}
+
+lval* lval_read_num(mpc_ast_t* tree) {
+  errno = 0;
+  long x = strtol(tree->contents, NULL, 10);
+  return errno != ERANGE
+    ? lval_num(x)
+    : lval_big(lbig_parse(tree->contents));
+}
+
+lval* lval_read_dbl(mpc_ast_t* tree) {
+  return lval_dbl(strtod(tree->contents, NULL));
+}
+
+/* a number or symbol, or NULL if tree is a list */
+lval* lval_read_atom(mpc_ast_t* tree) {
+  if (strstr(tree->tag, "float")) { return lval_read_dbl(tree); }
+  if (strstr(tree->tag, "number")) { return lval_read_num(tree); }
+  if (strstr(tree->tag, "symbol")) { return lval_sym(tree->contents); }
+  return NULL;
+}
+
+/* the next child of a list from *next on, skipping brackets; or NULL */
+mpc_ast_t* lval_read_next(mpc_ast_t* tree, int* next) {
+  while (*next < tree->children_num) {
+    mpc_ast_t* child = tree->children[(*next)++];
+
+    if (strcmp(child->contents, "(") == 0) { continue; }
+    if (strcmp(child->contents, ")") == 0) { continue; }
+    if (strcmp(child->contents, "{") == 0) { continue; }
+    if (strcmp(child->contents, "}") == 0) { continue; }
+
+    if (strcmp(child->tag, "regex") == 0) { continue; }
+
+    return child;
+  }
+  return NULL;
+}
+
+/*
+ * Lists are read off a stack of the ones still open rather than by
+ * recursion; lval_read_depth has already seen to it that the tree isn't
+ * deeper than mpc could cope with, but the stack costs nothing.
+ */
+lval* lval_read(mpc_ast_t* tree) {
+  struct { mpc_ast_t* tree; lval* val; int next; }* open = NULL;
+  int depth = 0;
+  int capacity = 0;
+
+  for (;;) {
+    lval* val = lval_read_atom(tree);
+
+    if (!val) {
+      if (depth == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        open = realloc(open, sizeof(*open) * capacity);
+      }
+      open[depth].tree = tree;
+      open[depth].val = strstr(tree->tag, "qexpr") ? lval_qexpr() : lval_sexpr();
+      open[depth].next = 0;
+      depth++;
+    }
+
+    /* add finished values to their lists until one has more to read */
+    for (;;) {
+      if (val) {
+        if (depth == 0) {
+          free(open);
+          return val;
+        }
+        open[depth - 1].val = lval_add(open[depth - 1].val, val);
+      }
+
+      tree = lval_read_next(open[depth - 1].tree, &open[depth - 1].next);
+      if (tree) { break; }
+
+      depth--;
+      val = open[depth].val;
+    }
+  }
+}
+
+/* the end of a string or comment starting at c, so that the brackets
+   inside one aren't counted */
+char* lval_read_skip(char* c) {
+  if (*c == ';') { return c + strcspn(c, "\r\n"); }
+  if (*c != '"') { return c; }
+  for (c++; *c && *c != '"'; c++) {
+    if (*c == '\\' && c[1]) { c++; }
+  }
+  return c;
+}
+
+/* mpc parses recursively, so its input has to be checked first */
+lval* lval_read_depth(char* input) {
+  long limit = ldepth.max < LDEPTH_C_MAX ? ldepth.max : LDEPTH_C_MAX;
+  long depth = 0;
+
+  for (char* c = input; *c; c++) {
+    c = lval_read_skip(c);
+    if (!*c) { break; }
+    if (*c == '(' || *c == '{') { depth++; }
+    if (*c == ')' || *c == '}') { depth--; }
+    if (depth > limit) {
+      return lval_err("Input nested more than %li deep", limit);
+    }
+  }
+
+  return NULL;
+}
+
+/* every expression in input, as one S-expression like a line of the REPL */
+lval* lval_read_string(char* input) {
+  lval* err = lval_read_depth(input);
+  if (err) { return err; }
+
+  mpc_result_t r;
+  if (!mpc_parse("<string>", input, grammar.Lispy, &r)) {
+    char* msg = mpc_err_string(r.error);
+    msg[strcspn(msg, "\n")] = '\0';
+    err = lval_err("%s", msg);
+    free(msg);
+    mpc_err_delete(r.error);
+    return err;
+  }
+
+  lval* result = lval_read(r.output);
+  mpc_ast_delete(r.output);
+  return result;
+}
+
+
+// Print
+
+/*
+ * the shortest form that reads back as the same double, with a point or
+ * an exponent so that it reads back as a double at all; buf needs 32
+ */
+void ldbl_format(double x, char* buf) {
+  if (isnan(x)) {
+    strcpy(buf, "nan");
+    return;
+  }
+  if (isinf(x)) {
+    strcpy(buf, x < 0 ? "-inf" : "inf");
+    return;
+  }
+
+  for (int precision = 15; precision <= 17; precision++) {
+    snprintf(buf, 32, "%.*g", precision, x);
+    if (strtod(buf, NULL) == x) { break; }
+  }
+  if (!strpbrk(buf, ".e")) { strcat(buf, ".0"); }
+}
+
+void lval_dbl_print(double x) {
+  char buf[32];
+  ldbl_format(x, buf);
+  fputs(buf, stdout);
+}
+void lval_big_print(lval* val) {
+  lbig big;
+  lbig_of(val, &big);
+  char* str = lbig_string(&big);
+  fputs(str, stdout);
+  free(str);
+}
+void lval_vec_print(lval* val) {
+  int reals = lval_vec_of(val)->reals;
+
+  putchar('[');
+  for (int i = 0; i < val->count; i++) {
+    if (i != 0) { putchar(' '); }
+    if (reals) {
+      lval_dbl_print(val->reals[i]);
+    } else {
+      printf("%li", val->nums[i]);
+    }
+  }
+  putchar(']');
+}
+/* how many values val prints around, or -1 if it prints by itself */
+int lval_print_count(lval* val) {
+  switch (lval_type_of(val)) {
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: return val->count;
+    case LVAL_FUN: return lval_is_builtin(val) || lval_is_memo(val) ? -1 : 2;
+    default: return -1;
+  }
+}
+
+/* the ith of those, the formals and body for a lambda */
+lval* lval_print_child(lval* val, int i) {
+  if (lval_type_of(val) == LVAL_FUN) {
+    return i == 0 ? val->lambda->formals : val->lambda->body;
+  }
+  return val->cell[i];
+}
+
+void lval_print_open(lval* val) {
+  switch (lval_type_of(val)) {
+    case LVAL_SEXPR: putchar('('); break;
+    case LVAL_QEXPR: putchar('{'); break;
+    default: printf("(\\ "); break;
+  }
+}
+
+void lval_print_close(lval* val) {
+  putchar(lval_type_of(val) == LVAL_QEXPR ? '}' : ')');
+}
+
+void lval_print_atom(lval* val) {
+  switch (lval_type_of(val)) {
+    case LVAL_ERR: printf("Error: %s", val->err); break;
+    case LVAL_NUM: printf("%li", lval_num_of(val)); break;
+    case LVAL_BIG: lval_big_print(val); break;
+    case LVAL_DBL: lval_dbl_print(lval_dbl_of(val)); break;
+    case LVAL_SYM: printf("%s", lval_sym_of(val)); break;
+    case LVAL_FUN: printf("<function>"); break;
+    case LVAL_VEC: lval_vec_print(val); break;
+    default: break;
+  }
+}
+
+/*
+ * Nested values print off a stack of the lists we are inside of and how
+ * far through each one we are, so nothing recurses on the C stack.
+ */
+void lval_print(lval* val) {
+  struct { lval* val; int next; }* outer = NULL;
+  int depth = 0;
+  int capacity = 0;
+  int next = 0;
+
+  for (;;) {
+    int count = lval_print_count(val);
+
+    if (count > 0 && next < count) {
+      if (next == 0) {
+        lval_print_open(val);
+      } else {
+        putchar(' ');
+      }
+
+      if (depth == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        outer = realloc(outer, sizeof(*outer) * capacity);
+      }
+      outer[depth].val = val;
+      outer[depth].next = next + 1;
+      depth++;
+
+      val = lval_print_child(val, next);
+      next = 0;
+      continue;
+    }
+
+    if (count < 0) {
+      lval_print_atom(val);
+    } else {
+      if (count == 0) { lval_print_open(val); }
+      lval_print_close(val);
+    }
+
+    if (depth == 0) { break; }
+    depth--;
+    val = outer[depth].val;
+    next = outer[depth].next;
+  }
+
+  free(outer);
+}
+
+void lval_println(lval* val) {
+  lval_print(val);
+  putchar('\n');
+}
+
+
+// Kernels
+
+/*
+ * Loops over packed longs, for the arithmetic builtins and for vectors.
+ * Every kernel comes in a scalar, an SSE2 and an AVX2 version, and
+ * lkernels_best picks the widest set the cpu we're running on supports.
+ *
+ * A sum flips the sign bit of every value, so it can be read as unsigned,
+ * and adds its low and high 32-bit halves into separate 64-bit
+ * accumulators. Those can't wrap for fewer than 2^32 values, so the exact
+ * total is rebuilt at the end and overflow is detected once rather than
+ * per element, which leaves the loop free to run in SIMD lanes.
+ *
+ * Dot products use the same trick when both sides fit in 32 bits: offset
+ * by 2^31 the factors are unsigned, their products can't wrap, and the
+ * offsets are taken back out of the total at the end.
+ *
+ * The double kernels need no such care, but sums and dot products add up
+ * lane by lane, so their rounding can differ from a left-to-right loop.
+ */
+
+#define LSUM_BIAS 0x8000000000000000UL
+#define LSUM_LOW 0xffffffffUL
+#define LDOT_BIAS 0x80000000UL
+
+typedef struct {
+  unsigned long lo;
+  unsigned long hi;
+} lsum_parts;
+
+typedef struct {
+  unsigned long lo;
+  unsigned long hi;
+  unsigned long offsets; /* the sum of every offset factor */
+} ldot_parts;
+
+void lsum_scalar(long* xs, int n, lsum_parts* parts) {
+  for (int i = 0; i < n; i++) {
+    unsigned long x = (unsigned long)xs[i] ^ LSUM_BIAS;
+    parts->lo += x & LSUM_LOW;
+    parts->hi += x >> 32;
+  }
+}
+
+/* out = xs + ys, or xs + y when ys is NULL; 0 if any of them overflows */
+int ladd_scalar(long* xs, long* ys, long y, long* out, int n) {
+  int overflow = 0;
+  for (int i = 0; i < n; i++) {
+    overflow |= __builtin_add_overflow(xs[i], ys ? ys[i] : y, &out[i]);
+  }
+  return !overflow;
+}
+
+/* every xs and ys must fit in 32 bits */
+void ldot_scalar(long* xs, long* ys, int n, ldot_parts* parts) {
+  for (int i = 0; i < n; i++) {
+    unsigned long x = (unsigned long)xs[i] + LDOT_BIAS;
+    unsigned long y = (unsigned long)ys[i] + LDOT_BIAS;
+    unsigned long product = x * y;
+    parts->lo += product & LSUM_LOW;
+    parts->hi += product >> 32;
+    parts->offsets += x + y;
+  }
+}
+
+double lfsum_scalar(double* xs, int n) {
+  double sum = 0;
+  for (int i = 0; i < n; i++) { sum += xs[i]; }
+  return sum;
+}
+
+/* out = xs + ys, or xs + y when ys is NULL */
+void lfadd_scalar(double* xs, double* ys, double y, double* out, int n) {
+  for (int i = 0; i < n; i++) { out[i] = xs[i] + (ys ? ys[i] : y); }
+}
+
+double lfdot_scalar(double* xs, double* ys, int n) {
+  double dot = 0;
+  for (int i = 0; i < n; i++) { dot += xs[i] * ys[i]; }
+  return dot;
+}
+
+void lsqrt_scalar(double* xs, double* out, int n) {
+  for (int i = 0; i < n; i++) { out[i] = sqrt(xs[i]); }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#define LKERNELS_SIMD
+
+/* SSE2 is part of x86-64, so these need no check */
+void lsum_sse2(long* xs, int n, lsum_parts* parts) {
+  __m128i bias = _mm_set1_epi64x((long)LSUM_BIAS);
+  __m128i low = _mm_set1_epi64x(LSUM_LOW);
+  __m128i lo = _mm_setzero_si128();
+  __m128i hi = _mm_setzero_si128();
+
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((__m128i*)(xs + i)), bias);
+    lo = _mm_add_epi64(lo, _mm_and_si128(x, low));
+    hi = _mm_add_epi64(hi, _mm_srli_epi64(x, 32));
+  }
+
+  unsigned long lanes[2];
+  _mm_storeu_si128((__m128i*)lanes, lo);
+  parts->lo += lanes[0] + lanes[1];
+  _mm_storeu_si128((__m128i*)lanes, hi);
+  parts->hi += lanes[0] + lanes[1];
+
+  lsum_scalar(xs + i, n - i, parts);
+}
+
+/* a lane overflowed if its sign differs from the sign of both operands */
+int ladd_sse2(long* xs, long* ys, long y, long* out, int n) {
+  __m128i yv = _mm_set1_epi64x(y);
+  __m128i overflow = _mm_setzero_si128();
+
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((__m128i*)(xs + i));
+    if (ys) { yv = _mm_loadu_si128((__m128i*)(ys + i)); }
+    __m128i sum = _mm_add_epi64(x, yv);
+    overflow = _mm_or_si128(overflow, _mm_and_si128(_mm_xor_si128(x, sum),
+                                                    _mm_xor_si128(yv, sum)));
+    _mm_storeu_si128((__m128i*)(out + i), sum);
+  }
+
+  int ok = !_mm_movemask_pd(_mm_castsi128_pd(overflow));
+  return ladd_scalar(xs + i, ys ? ys + i : NULL, y, out + i, n - i) && ok;
+}
+
+void ldot_sse2(long* xs, long* ys, int n, ldot_parts* parts) {
+  __m128i bias = _mm_set1_epi64x(LDOT_BIAS);
+  __m128i low = _mm_set1_epi64x(LSUM_LOW);
+  __m128i lo = _mm_setzero_si128();
+  __m128i hi = _mm_setzero_si128();
+  __m128i offsets = _mm_setzero_si128();
+
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((__m128i*)(xs + i));
+    __m128i y = _mm_loadu_si128((__m128i*)(ys + i));
+    x = _mm_and_si128(_mm_xor_si128(x, bias), low);
+    y = _mm_and_si128(_mm_xor_si128(y, bias), low);
+    __m128i product = _mm_mul_epu32(x, y);
+    lo = _mm_add_epi64(lo, _mm_and_si128(product, low));
+    hi = _mm_add_epi64(hi, _mm_srli_epi64(product, 32));
+    offsets = _mm_add_epi64(offsets, _mm_add_epi64(x, y));
+  }
+
+  unsigned long lanes[2];
+  _mm_storeu_si128((__m128i*)lanes, lo);
+  parts->lo += lanes[0] + lanes[1];
+  _mm_storeu_si128((__m128i*)lanes, hi);
+  parts->hi += lanes[0] + lanes[1];
+  _mm_storeu_si128((__m128i*)lanes, offsets);
+  parts->offsets += lanes[0] + lanes[1];
+
+  ldot_scalar(xs + i, ys + i, n - i, parts);
+}
+
+double lfsum_sse2(double* xs, int n) {
+  __m128d sum = _mm_setzero_pd();
+
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    sum = _mm_add_pd(sum, _mm_loadu_pd(xs + i));
+  }
+
+  double lanes[2];
+  _mm_storeu_pd(lanes, sum);
+  return lanes[0] + lanes[1] + lfsum_scalar(xs + i, n - i);
+}
+
+void lfadd_sse2(double* xs, double* ys, double y, double* out, int n) {
+  __m128d yv = _mm_set1_pd(y);
+
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    if (ys) { yv = _mm_loadu_pd(ys + i); }
+    _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(xs + i), yv));
+  }
+
+  lfadd_scalar(xs + i, ys ? ys + i : NULL, y, out + i, n - i);
+}
+
+double lfdot_sse2(double* xs, double* ys, int n) {
+  __m128d dot = _mm_setzero_pd();
+
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d product = _mm_mul_pd(_mm_loadu_pd(xs + i), _mm_loadu_pd(ys + i));
+    dot = _mm_add_pd(dot, product);
+  }
+
+  double lanes[2];
+  _mm_storeu_pd(lanes, dot);
+  return lanes[0] + lanes[1] + lfdot_scalar(xs + i, ys + i, n - i);
+}
+
+void lsqrt_sse2(double* xs, double* out, int n) {
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    _mm_storeu_pd(out + i, _mm_sqrt_pd(_mm_loadu_pd(xs + i)));
+  }
+
+  lsqrt_scalar(xs + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void lsum_avx2(long* xs, int n, lsum_parts* parts) {
+  __m256i bias = _mm256_set1_epi64x((long)LSUM_BIAS);
+  __m256i low = _mm256_set1_epi64x(LSUM_LOW);
+  __m256i lo = _mm256_setzero_si256();
+  __m256i hi = _mm256_setzero_si256();
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(xs + i)), bias);
+    lo = _mm256_add_epi64(lo, _mm256_and_si256(x, low));
+    hi = _mm256_add_epi64(hi, _mm256_srli_epi64(x, 32));
+  }
+
+  unsigned long lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, lo);
+  parts->lo += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  _mm256_storeu_si256((__m256i*)lanes, hi);
+  parts->hi += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+  lsum_scalar(xs + i, n - i, parts);
+}
+
+__attribute__((target("avx2")))
+int ladd_avx2(long* xs, long* ys, long y, long* out, int n) {
+  __m256i yv = _mm256_set1_epi64x(y);
+  __m256i overflow = _mm256_setzero_si256();
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((__m256i*)(xs + i));
+    if (ys) { yv = _mm256_loadu_si256((__m256i*)(ys + i)); }
+    __m256i sum = _mm256_add_epi64(x, yv);
+    overflow = _mm256_or_si256(overflow,
+                               _mm256_and_si256(_mm256_xor_si256(x, sum),
+                                                _mm256_xor_si256(yv, sum)));
+    _mm256_storeu_si256((__m256i*)(out + i), sum);
+  }
+
+  int ok = !_mm256_movemask_pd(_mm256_castsi256_pd(overflow));
+  return ladd_scalar(xs + i, ys ? ys + i : NULL, y, out + i, n - i) && ok;
+}
+
+__attribute__((target("avx2")))
+void ldot_avx2(long* xs, long* ys, int n, ldot_parts* parts) {
+  __m256i bias = _mm256_set1_epi64x(LDOT_BIAS);
+  __m256i low = _mm256_set1_epi64x(LSUM_LOW);
+  __m256i lo = _mm256_setzero_si256();
+  __m256i hi = _mm256_setzero_si256();
+  __m256i offsets = _mm256_setzero_si256();
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((__m256i*)(xs + i));
+    __m256i y = _mm256_loadu_si256((__m256i*)(ys + i));
+    x = _mm256_and_si256(_mm256_xor_si256(x, bias), low);
+    y = _mm256_and_si256(_mm256_xor_si256(y, bias), low);
+    __m256i product = _mm256_mul_epu32(x, y);
+    lo = _mm256_add_epi64(lo, _mm256_and_si256(product, low));
+    hi = _mm256_add_epi64(hi, _mm256_srli_epi64(product, 32));
+    offsets = _mm256_add_epi64(offsets, _mm256_add_epi64(x, y));
+  }
+
+  unsigned long lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, lo);
+  parts->lo += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  _mm256_storeu_si256((__m256i*)lanes, hi);
+  parts->hi += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  _mm256_storeu_si256((__m256i*)lanes, offsets);
+  parts->offsets += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+  ldot_scalar(xs + i, ys + i, n - i, parts);
+}
+
+__attribute__((target("avx2")))
+double lfsum_avx2(double* xs, int n) {
+  __m256d sum = _mm256_setzero_pd();
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    sum = _mm256_add_pd(sum, _mm256_loadu_pd(xs + i));
+  }
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, sum);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+    + lfsum_scalar(xs + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void lfadd_avx2(double* xs, double* ys, double y, double* out, int n) {
+  __m256d yv = _mm256_set1_pd(y);
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    if (ys) { yv = _mm256_loadu_pd(ys + i); }
+    _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(xs + i), yv));
+  }
+
+  lfadd_scalar(xs + i, ys ? ys + i : NULL, y, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+double lfdot_avx2(double* xs, double* ys, int n) {
+  __m256d dot = _mm256_setzero_pd();
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d product = _mm256_mul_pd(_mm256_loadu_pd(xs + i),
+                                    _mm256_loadu_pd(ys + i));
+    dot = _mm256_add_pd(dot, product);
+  }
+
+  double lanes[4];
+  _mm256_storeu_pd(lanes, dot);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+    + lfdot_scalar(xs + i, ys + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void lsqrt_avx2(double* xs, double* out, int n) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_sqrt_pd(_mm256_loadu_pd(xs + i)));
+  }
+
+  lsqrt_scalar(xs + i, out + i, n - i);
+}
+
+#endif
+
+typedef struct {
+  char* name;
+  void (*sum)(long* xs, int n, lsum_parts* parts);
+  int (*add)(long* xs, long* ys, long y, long* out, int n);
+  void (*dot)(long* xs, long* ys, int n, ldot_parts* parts);
+  double (*fsum)(double* xs, int n);
+  void (*fadd)(double* xs, double* ys, double y, double* out, int n);
+  double (*fdot)(double* xs, double* ys, int n);
+  void (*sqrt)(double* xs, double* out, int n);
+} lkernels;
+
+/* narrowest first */
+lkernels lkernel_sets[] = {
+  { "scalar", lsum_scalar, ladd_scalar, ldot_scalar,
+    lfsum_scalar, lfadd_scalar, lfdot_scalar, lsqrt_scalar },
+#ifdef LKERNELS_SIMD
+  { "sse2", lsum_sse2, ladd_sse2, ldot_sse2,
+    lfsum_sse2, lfadd_sse2, lfdot_sse2, lsqrt_sse2 },
+  { "avx2", lsum_avx2, ladd_avx2, ldot_avx2,
+    lfsum_avx2, lfadd_avx2, lfdot_avx2, lsqrt_avx2 },
+#endif
+};
+
+#define LKERNEL_SET_COUNT (int)(sizeof(lkernel_sets) / sizeof(lkernels))
+
+int lkernels_supported(lkernels* kernels) {
+#ifdef LKERNELS_SIMD
+  if (kernels->sum == lsum_avx2) { return __builtin_cpu_supports("avx2"); }
+#endif
+  return 1;
+}
+
+lkernels* lkernels_best(void) {
+  static lkernels* best = NULL;
+  if (best == NULL) {
+    for (int i = 0; i < LKERNEL_SET_COUNT; i++) {
+      if (lkernels_supported(&lkernel_sets[i])) { best = &lkernel_sets[i]; }
+    }
+  }
+  return best;
+}
+
+/* sums xs into result; 0 if the sum overflows */
+int lsum_with(lkernels* kernels, long* xs, int n, long* result) {
+  lsum_parts parts = { 0, 0 };
+  kernels->sum(xs, n, &parts);
+
+  __int128 sum = ((__int128)parts.hi << 32) + parts.lo
+    - ((__int128)n << 63);
+  if (sum < LONG_MIN || sum > LONG_MAX) { return 0; }
+
+  *result = (long)sum;
+  return 1;
+}
+
+int lsum_longs(long* xs, int n, long* result) {
+  return lsum_with(lkernels_best(), xs, n, result);
+}
+
+/* the dot product of xs and ys, which must fit in 32 bits; 0 on overflow */
+int ldot_with(lkernels* kernels, long* xs, long* ys, int n, long* result) {
+  ldot_parts parts = { 0, 0, 0 };
+  kernels->dot(xs, ys, n, &parts);
+
+  __int128 dot = ((__int128)parts.hi << 32) + parts.lo
+    - (__int128)parts.offsets * LDOT_BIAS
+    + ((__int128)n << 62);
+  if (dot < LONG_MIN || dot > LONG_MAX) { return 0; }
+
+  *result = (long)dot;
+  return 1;
+}
+
+/* the arguments of an arithmetic builtin, unboxed into one array */
+#define LNUMS_SMALL 16
+
+typedef struct {
+  int count;
+  long* xs;
+  long small[LNUMS_SMALL];
+} lnums;
+
+void lnums_free(lnums* nums) {
+  if (nums->xs != nums->small) { free(nums->xs); }
+}
+
+/* checks and unboxes every argument in one pass; 0 if one isn't a number */
+int lnums_unbox(lnums* nums, lval* args) {
+  nums->count = args->count;
+  nums->xs = nums->small;
+  if (args->count > LNUMS_SMALL) {
+    nums->xs = malloc(sizeof(long) * args->count);
+  }
+
+  for (int i = 0; i < args->count; i++) {
+    if (lval_type_of(args->cell[i]) != LVAL_NUM) {
+      lnums_free(nums);
+      return 0;
+    }
+    nums->xs[i] = lval_num_of(args->cell[i]);
+  }
+
+  return 1;
+}
+
+
+// Eval
+
+lval* lval_eval(lenv* env, lframe* frame, lval* val);
+lval* lval_run(lenv* env, lval* val);
+lval* lval_run_quoted(lenv* env, lframe* frame, lval* code);
+lval* lvm_run(lenv* env, struct lchunk* chunk, lframe* frame);
+struct lchunk* llambda_code(llambda* lambda);
+
+/* set by --tree-walk; evaluate with the reference lval_eval instead */
+int vm_disabled = 0;
+
+/* the frame of the code applying a builtin, which eval and if run their
+   Q-expression with; set by each evaluator before it applies one */
+lframe* lcaller = NULL;
+
+#define LASSERT(args, cond, fmt, ...)         \
+  if (!(cond)) {                              \
+    lval* err = lval_err(fmt, ##__VA_ARGS__); \
+    lval_del(args);                           \
+    return err;                                    \
+  }                                           \
+
+
+/* the whole calculation again on bignums; every argument is an integer */
+lval* lval_arith_big(lval* val, char op) {
+  /* these borrow from the arguments, so val has to outlive them */
+  lbig* xs = malloc(sizeof(lbig) * val->count);
+  for (int i = 0; i < val->count; i++) { lbig_of(val->cell[i], &xs[i]); }
+
+  lbig acc;
+  if (op == '*') {
+    acc = lbig_product(xs, 0, val->count);
+  } else if (op == '-' && val->count == 1) {
+    acc = lbig_neg(&xs[0]);
+  } else {
+    acc = lbig_copy(&xs[0]);
+    for (int i = 1; i < val->count; i++) {
+      if (op == '/' && xs[i].size == 0) {
+        free(acc.digits);
+        free(xs);
+        lval_del(val);
+        return lval_err("division by zero");
+      }
+
+      lbig next =
+        op == '+' ? lbig_add(&acc, &xs[i]) :
+        op == '-' ? lbig_sub(&acc, &xs[i]) :
+        lbig_div(&acc, &xs[i]);
+      free(acc.digits);
+      acc = next;
+    }
+  }
+
+  free(xs);
+  lval_del(val);
+  return lval_big(acc);
+}
+
+double lval_to_dbl(lval* val) {
+  switch (lval_type_of(val)) {
+    case LVAL_NUM: return lval_num_of(val);
+    case LVAL_DBL: return lval_dbl_of(val);
+    default: break;
+  }
+
+  /* strtod rounds correctly, which adding up digits wouldn't */
+  lbig big;
+  lbig_of(val, &big);
+  char* str = lbig_string(&big);
+  double x = strtod(str, NULL);
+  free(str);
+  return x;
+}
+
+/* with any double involved, so is everything else; only the result is boxed */
+lval* lval_arith_dbl(lval* val, char op) {
+  double acc = lval_to_dbl(val->cell[0]);
+  if (op == '-' && val->count == 1) { acc = -acc; }
+
+  for (int i = 1; i < val->count; i++) {
+    lval* arg = val->cell[i];
+    double x = lval_to_dbl(arg);
+
+    switch (op) {
+      case '+': acc += x; break;
+      case '-': acc -= x; break;
+      case '*': acc *= x; break;
+      case '/':
+        /* dividing by 0.0 gives an infinity, but 0 is still an error */
+        LASSERT(val, lval_type_of(arg) == LVAL_DBL || x != 0,
+                "division by zero");
+        acc /= x;
+        break;
+    }
+  }
+
+  lval_del(val);
+  return lval_dbl(acc);
+}
+
+/*
+ * The slow path of the arithmetic builtins, for when an argument isn't a
+ * long or the result on longs overflowed: the whole calculation is redone
+ * on doubles if any argument is one, or else on bignums.
+ */
+lval* lval_arith_slow(lval* val, char op) {
+  int dbl = 0;
+  for (int i = 0; i < val->count; i++) {
+    int type = lval_type_of(val->cell[i]);
+    LASSERT(val, type == LVAL_NUM || type == LVAL_BIG || type == LVAL_DBL,
+            "Function '%c' passed a non-number", op);
+    dbl |= type == LVAL_DBL;
+  }
+
+  return dbl ? lval_arith_dbl(val, op) : lval_arith_big(val, op);
+}
+
+lval* builtin_add(lenv* env, lval* val) {
+  lnums nums;
+  if (!lnums_unbox(&nums, val)) { return lval_arith_slow(val, '+'); }
+
+  long acc;
+  int ok = lsum_longs(nums.xs, nums.count, &acc);
+  lnums_free(&nums);
+  if (!ok) { return lval_arith_slow(val, '+'); }
+
+  lval_del(val);
+  return lval_num(acc);
+}
+
+lval* builtin_mul(lenv* env, lval* val) {
+  lnums nums;
+  if (!lnums_unbox(&nums, val)) { return lval_arith_slow(val, '*'); }
+
+  /* products overflow too quickly to be worth splitting into lanes */
+  long acc = 1;
+  int ok = 1;
+  for (int i = 0; ok && i < nums.count; i++) {
+    ok = !__builtin_mul_overflow(acc, nums.xs[i], &acc);
+  }
+  lnums_free(&nums);
+  if (!ok) { return lval_arith_slow(val, '*'); }
+
+  lval_del(val);
+  return lval_num(acc);
+}
+
+lval* builtin_sub(lenv* env, lval* val) {
+  LASSERT(val, val->count > 0, "Function '-' passed no arguments");
+
+  lnums nums;
+  if (!lnums_unbox(&nums, val)) { return lval_arith_slow(val, '-'); }
+
+  long acc;
+  int ok;
+  if (nums.count == 1) {
+    // unary minus
+    ok = !__builtin_sub_overflow(0, nums.xs[0], &acc);
+  } else {
+    long rest;
+    ok = lsum_longs(nums.xs + 1, nums.count - 1, &rest)
+      && !__builtin_sub_overflow(nums.xs[0], rest, &acc);
+  }
+  lnums_free(&nums);
+  if (!ok) { return lval_arith_slow(val, '-'); }
+
+  lval_del(val);
+  return lval_num(acc);
+}
+
+lval* builtin_div(lenv* env, lval* val) {
+  LASSERT(val, val->count > 0, "Function '/' passed no arguments");
+
+  lnums nums;
+  if (!lnums_unbox(&nums, val)) { return lval_arith_slow(val, '/'); }
+
+  lval* result = NULL;
+  long acc = nums.xs[0];
+  for (int i = 1; result == NULL && i < nums.count; i++) {
+    if (nums.xs[i] == 0) {
+      result = lval_err("division by zero");
+    } else if (acc == LONG_MIN && nums.xs[i] == -1) {
+      /* the only quotient of two longs that isn't one */
+      lnums_free(&nums);
+      return lval_arith_slow(val, '/');
+    } else {
+      acc /= nums.xs[i];
+    }
+  }
+  lnums_free(&nums);
+
+  lval_del(val);
+  return result ? result : lval_num(acc);
+}
+
+/* (vec 1 2 3) packs its arguments, (vec {1 2 3}) the numbers in a list */
+lval* builtin_vec(lenv* env, lval* val) {
+  lval* source = val;
+  if (val->count == 1 && lval_type_of(val->cell[0]) == LVAL_QEXPR) {
+    source = val->cell[0];
+  }
+
+  /* one double makes it a vector of doubles */
+  int reals = 0;
+  for (int i = 0; i < source->count; i++) {
+    int type = lval_type_of(source->cell[i]);
+    LASSERT(val, type != LVAL_BIG,
+            "Function 'vec' passed a number too big for a vector");
+    LASSERT(val, type == LVAL_NUM || type == LVAL_DBL,
+            "Function 'vec' passed a non-number");
+    reals |= type == LVAL_DBL;
+  }
+
+  lvec* vec = lvec_new(source->count, reals);
+  for (int i = 0; i < source->count; i++) {
+    if (reals) {
+      lvec_reals(vec)[i] = lval_to_dbl(source->cell[i]);
+    } else {
+      vec->items[i] = lval_num_of(source->cell[i]);
+    }
+  }
+
+  lval_del(val);
+  return lval_vec(lvec_seal(vec), 0, vec->count);
+}
+
+/* a vector's numbers as doubles; free it if it isn't val->reals */
+double* lval_vec_reals(lval* val) {
+  if (lval_vec_of(val)->reals) { return val->reals; }
+
+  double* reals = malloc(sizeof(double) * ((unsigned)val->count + 1));
+  for (int i = 0; i < val->count; i++) { reals[i] = val->nums[i]; }
+  return reals;
+}
+
+void lval_vec_reals_free(lval* val, double* reals) {
+  if (reals != val->reals) { free(reals); }
+}
+
+lval* builtin_vlen(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1,
+          "Function 'vlen' passed too many arguments");
+  LASSERT(val, lval_type_of(val->cell[0]) == LVAL_VEC,
+          "Function 'vlen' passed incorrect type");
+
+  long len = val->cell[0]->count;
+  lval_del(val);
+  return lval_num(len);
+}
+
+lval* builtin_vsum(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1,
+          "Function 'vsum' passed too many arguments");
+  LASSERT(val, lval_type_of(val->cell[0]) == LVAL_VEC,
+          "Function 'vsum' passed incorrect type");
+
+  lval* xs = val->cell[0];
+  lval* result;
+  if (lval_vec_of(xs)->reals) {
+    result = lval_dbl(lkernels_best()->fsum(xs->reals, xs->count));
+  } else {
+    long sum;
+    result = lsum_longs(xs->nums, xs->count, &sum)
+      ? lval_num(sum)
+      : lval_err("integer overflow");
+  }
+
+  lval_del(val);
+  return result;
+}
+
+/* adds a number to every element, or two vectors element by element */
+lval* builtin_vmap_add(lenv* env, lval* val) {
+  LASSERT(val, val->count == 2,
+          "Function 'vmap+' passed %i arguments, expected 2", val->count);
+  LASSERT(val, lval_type_of(val->cell[0]) == LVAL_VEC,
+          "Function 'vmap+' passed incorrect type for argument 0");
+
+  lval* xs = val->cell[0];
+  lval* y = val->cell[1];
+  int type = lval_type_of(y);
+  LASSERT(val, type == LVAL_NUM || type == LVAL_DBL || type == LVAL_VEC,
+          "Function 'vmap+' passed incorrect type for argument 1");
+  LASSERT(val, type != LVAL_VEC || y->count == xs->count,
+          "Function 'vmap+' passed vectors of lengths %i and %i",
+          xs->count, y->count);
+
+  int reals = lval_vec_of(xs)->reals || type == LVAL_DBL
+    || (type == LVAL_VEC && lval_vec_of(y)->reals);
+  lvec* vec = lvec_new(xs->count, reals);
+
+  if (reals) {
+    double* xr = lval_vec_reals(xs);
+    double* yr = type == LVAL_VEC ? lval_vec_reals(y) : NULL;
+    double scalar = type == LVAL_VEC ? 0 : lval_to_dbl(y);
+    lkernels_best()->fadd(xr, yr, scalar, lvec_reals(vec), xs->count);
+    lval_vec_reals_free(xs, xr);
+    if (yr) { lval_vec_reals_free(y, yr); }
+    lval_del(val);
+    return lval_vec(vec, 0, vec->count);
+  }
+
+  int ok = type == LVAL_NUM
+    ? lkernels_best()->add(xs->nums, NULL, lval_num_of(y),
+                           vec->items, xs->count)
+    : lkernels_best()->add(xs->nums, y->nums, 0, vec->items, xs->count);
+  lval_del(val);
+
+  if (!ok) {
+    lvec_release(vec);
+    return lval_err("integer overflow");
+  }
+  return lval_vec(lvec_seal(vec), 0, vec->count);
+}
+
+lval* builtin_vdot(lenv* env, lval* val) {
+  LASSERT(val, val->count == 2,
+          "Function 'vdot' passed %i arguments, expected 2", val->count);
+  LASSERT(val, lval_type_of(val->cell[0]) == LVAL_VEC
+          && lval_type_of(val->cell[1]) == LVAL_VEC,
+          "Function 'vdot' passed incorrect type");
+
+  lval* xs = val->cell[0];
+  lval* ys = val->cell[1];
+  LASSERT(val, xs->count == ys->count,
+          "Function 'vdot' passed vectors of lengths %i and %i",
+          xs->count, ys->count);
+
+  if (lval_vec_of(xs)->reals || lval_vec_of(ys)->reals) {
+    double* xr = lval_vec_reals(xs);
+    double* yr = lval_vec_reals(ys);
+    double dot = lkernels_best()->fdot(xr, yr, xs->count);
+    lval_vec_reals_free(xs, xr);
+    lval_vec_reals_free(ys, yr);
+    lval_del(val);
+    return lval_dbl(dot);
+  }
+
+  /* wider numbers can overflow any product, so check each one */
+  long dot = 0;
+  int ok = 1;
+  if (lval_vec_of(xs)->narrow && lval_vec_of(ys)->narrow) {
+    ok = ldot_with(lkernels_best(), xs->nums, ys->nums, xs->count, &dot);
+  } else {
+    for (int i = 0; ok && i < xs->count; i++) {
+      long product;
+      ok = !__builtin_mul_overflow(xs->nums[i], ys->nums[i], &product)
+        && !__builtin_add_overflow(dot, product, &dot);
+    }
+  }
+  lval_del(val);
+
+  return ok ? lval_num(dot) : lval_err("integer overflow");
+}
+
+/* (vslice v start end) shares v's numbers from start up to end */
+lval* builtin_vslice(lenv* env, lval* val) {
+  LASSERT(val, val->count == 3,
+          "Function 'vslice' passed %i arguments, expected 3", val->count);
+  LASSERT(val, lval_type_of(val->cell[0]) == LVAL_VEC
+          && lval_type_of(val->cell[1]) == LVAL_NUM
+          && lval_type_of(val->cell[2]) == LVAL_NUM,
+          "Function 'vslice' passed incorrect type");
+
+  lval* xs = val->cell[0];
+  long start = lval_num_of(val->cell[1]);
+  long end = lval_num_of(val->cell[2]);
+  LASSERT(val, 0 <= start && start <= end && end <= xs->count,
+          "Function 'vslice' passed bounds %li and %li for length %i",
+          start, end, xs->count);
+
+  lvec* vec = lval_vec_of(xs);
+  vec->refs++;
+  lval* result = lval_vec(vec, xs->front + start, end - start);
+  lval_del(val);
+
+  return result;
+}
+
+/*
+ * The math builtins work on a number, a list of numbers or a vector, and
+ * give back the same shape holding doubles. Either way the numbers are
+ * unpacked into one array and run through a kernel in a single pass.
+ * sqrt has SIMD kernels; exp, log and pow stay with libm, whose results
+ * are more accurate than a vectorized approximation would be.
+ */
+typedef void (*lmath_kernel)(double* xs, double* out, int n, double y);
+
+void lmath_sqrt(double* xs, double* out, int n, double y) {
+  lkernels_best()->sqrt(xs, out, n);
+}
+
+void lmath_exp(double* xs, double* out, int n, double y) {
+  for (int i = 0; i < n; i++) { out[i] = exp(xs[i]); }
+}
+
+void lmath_log(double* xs, double* out, int n, double y) {
+  for (int i = 0; i < n; i++) { out[i] = log(xs[i]); }
+}
+
+void lmath_pow(double* xs, double* out, int n, double y) {
+  for (int i = 0; i < n; i++) { out[i] = pow(xs[i], y); }
+}
+
+int lval_is_number(lval* val) {
+  int type = lval_type_of(val);
+  return type == LVAL_NUM || type == LVAL_BIG || type == LVAL_DBL;
+}
+
+/* consumes val */
+lval* lval_math(lval* val, char* name, lmath_kernel kernel, double y) {
+  if (lval_is_number(val)) {
+    double x = lval_to_dbl(val);
+    lval_del(val);
+    kernel(&x, &x, 1, y);
+    return lval_dbl(x);
+  }
+
+  if (lval_type_of(val) == LVAL_VEC) {
+    lvec* vec = lvec_new(val->count, 1);
+    double* xs = lval_vec_reals(val);
+    kernel(xs, lvec_reals(vec), val->count, y);
+    lval_vec_reals_free(val, xs);
+    lval_del(val);
+    return lval_vec(vec, 0, vec->count);
+  }
+
+  LASSERT(val, lval_type_of(val) == LVAL_QEXPR,
+          "Function '%s' passed incorrect type", name);
+  for (int i = 0; i < val->count; i++) {
+    LASSERT(val, lval_is_number(val->cell[i]),
+            "Function '%s' passed a non-number", name);
+  }
+
+  double* xs = malloc(sizeof(double) * ((unsigned)val->count + 1));
+  for (int i = 0; i < val->count; i++) { xs[i] = lval_to_dbl(val->cell[i]); }
+  kernel(xs, xs, val->count, y);
+
+  lval* result = lval_qexpr();
+  lval_reserve(result, val->count);
+  for (int i = 0; i < val->count; i++) {
+    result = lval_add(result, lval_dbl(xs[i]));
+  }
+
+  free(xs);
+  lval_del(val);
+  return result;
+}
+
+lval* builtin_sqrt(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1, "Function 'sqrt' passed too many arguments");
+  return lval_math(lval_take(val, 0), "sqrt", lmath_sqrt, 0);
+}
+
+lval* builtin_exp(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1, "Function 'exp' passed too many arguments");
+  return lval_math(lval_take(val, 0), "exp", lmath_exp, 0);
+}
+
+lval* builtin_log(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1, "Function 'log' passed too many arguments");
+  return lval_math(lval_take(val, 0), "log", lmath_log, 0);
+}
+
+/* (pow xs y) raises every number in xs to the power y */
+lval* builtin_pow(lenv* env, lval* val) {
+  LASSERT(val, val->count == 2,
+          "Function 'pow' passed %i arguments, expected 2", val->count);
+  LASSERT(val, lval_is_number(val->cell[1]),
+          "Function 'pow' passed incorrect type for argument 1");
+
+  double y = lval_to_dbl(val->cell[1]);
+  return lval_math(lval_take(val, 0), "pow", lmath_pow, y);
+}
+
+/* a condition for 'if': any number but zero */
+int lval_is_true(lval* val) {
+  switch (lval_type_of(val)) {
+    case LVAL_NUM: return lval_num_of(val) != 0;
+    case LVAL_DBL: return lval_dbl_of(val) != 0.0;
+    default: return 1;
+  }
+}
+
+/* -1, 0 or 1 as x is less than, equal to or greater than y, or 2 if
+   either is a nan; numbers of any kind compare by value */
+int lval_num_cmp(lval* x, lval* y) {
+  if (lval_type_of(x) == LVAL_DBL || lval_type_of(y) == LVAL_DBL) {
+    double a = lval_to_dbl(x);
+    double b = lval_to_dbl(y);
+    if (a != a || b != b) { return 2; }
+    return (a > b) - (a < b);
+  }
+
+  if (lval_type_of(x) == LVAL_NUM && lval_type_of(y) == LVAL_NUM) {
+    long a = lval_num_of(x);
+    long b = lval_num_of(y);
+    return (a > b) - (a < b);
+  }
+
+  lbig a, b;
+  lbig_of(x, &a);
+  lbig_of(y, &b);
+  return lbig_cmp(&a, &b);
+}
+
+/* x and y on their own, taking it on trust that any cells are equal */
+int lval_eq_one(lval* x, lval* y) {
+  if (lval_is_number(x) && lval_is_number(y)) {
+    return lval_num_cmp(x, y) == 0;
+  }
+  if (lval_type_of(x) != lval_type_of(y)) { return 0; }
+
+  switch (lval_type_of(x)) {
+    case LVAL_ERR: return strcmp(x->err, y->err) == 0;
+    case LVAL_SYM: return x == y;
+
+    case LVAL_FUN: {
+      if (lval_is_builtin(x) || lval_is_builtin(y)) { return x == y; }
+      if (lval_is_memo(x) || lval_is_memo(y)) {
+        return x->lambda == y->lambda;
+      }
+      /* the captured values themselves are compared by lval_eq */
+      lscope* a = &x->lambda->scope;
+      lscope* b = &y->lambda->scope;
+      if (a->count != b->count || a->locals != b->locals) { return 0; }
+      for (int i = a->locals; i < a->count; i++) {
+        if (a->names[i] != b->names[i]) { return 0; }
+      }
+      return 1;
+    }
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: return x->count == y->count;
+
+    case LVAL_VEC: {
+      if (x->count != y->count) { return 0; }
+      int xreals = lval_vec_of(x)->reals;
+      int yreals = lval_vec_of(y)->reals;
+      for (int i = 0; i < x->count; i++) {
+        double a = xreals ? x->reals[i] : (double)x->nums[i];
+        double b = yreals ? y->reals[i] : (double)y->nums[i];
+        if (xreals || yreals ? a != b : x->nums[i] != y->nums[i]) { return 0; }
+      }
+      return 1;
+    }
+
+    default: return 0;
+  }
+}
+
+/* compares pairs off a stack, so nesting depth doesn't matter */
+int lval_eq(lval* x, lval* y) {
+  if (lval_type_of(x) != LVAL_SEXPR && lval_type_of(x) != LVAL_QEXPR
+      && !lval_is_lambda(x)) {
+    return lval_eq_one(x, y);
+  }
+
+  lstack pairs = { 0 };
+  int eq = 1;
+
+  lstack_push(&pairs, x);
+  lstack_push(&pairs, y);
+  while (pairs.count > 0) {
+    y = lstack_pop(&pairs);
+    x = lstack_pop(&pairs);
+    eq = lval_eq_one(x, y);
+    if (!eq) { break; }
+
+    if (lval_is_lambda(x)) {
+      llambda* a = x->lambda;
+      llambda* b = y->lambda;
+      lstack_push(&pairs, a->formals);
+      lstack_push(&pairs, b->formals);
+      lstack_push(&pairs, a->body);
+      lstack_push(&pairs, b->body);
+      for (int i = 0; i < a->scope.count - a->scope.locals; i++) {
+        lstack_push(&pairs, a->captured[i]);
+        lstack_push(&pairs, b->captured[i]);
+      }
+    }
+    if (lval_type_of(x) == LVAL_SEXPR || lval_type_of(x) == LVAL_QEXPR) {
+      for (int i = x->count - 1; i >= 0; i--) {
+        lstack_push(&pairs, x->cell[i]);
+        lstack_push(&pairs, y->cell[i]);
+      }
+    }
+  }
+
+  free(pairs.items);
+  return eq;
+}
+
+lval* builtin_eq(lenv* env, lval* val) {
+  LASSERT(val, val->count == 2,
+          "Function '==' passed %i arguments, expected 2", val->count);
+
+  int result = lval_eq(val->cell[0], val->cell[1]);
+  lval_del(val);
+  return lval_num(result);
+}
+
+lval* builtin_ne(lenv* env, lval* val) {
+  LASSERT(val, val->count == 2,
+          "Function '!=' passed %i arguments, expected 2", val->count);
+
+  int result = !lval_eq(val->cell[0], val->cell[1]);
+  lval_del(val);
+  return lval_num(result);
+}
+
+/* op is one of <, >, <= and >= */
+lval* lval_ord(lval* val, char* op) {
+  LASSERT(val, val->count == 2,
+          "Function '%s' passed %i arguments, expected 2", op, val->count);
+  LASSERT(val, lval_is_number(val->cell[0]) && lval_is_number(val->cell[1]),
+          "Function '%s' passed a non-number", op);
+
+  int cmp = lval_num_cmp(val->cell[0], val->cell[1]);
+  lval_del(val);
+
+  /* nothing is ordered against a nan */
+  if (cmp == 2) { return lval_num(0); }
+  if (op[1] == '=' && cmp == 0) { return lval_num(1); }
+  return lval_num(op[0] == '<' ? cmp < 0 : cmp > 0);
+}
+
+lval* builtin_lt(lenv* env, lval* val) { return lval_ord(val, "<"); }
+lval* builtin_gt(lenv* env, lval* val) { return lval_ord(val, ">"); }
+lval* builtin_le(lenv* env, lval* val) { return lval_ord(val, "<="); }
+lval* builtin_ge(lenv* env, lval* val) { return lval_ord(val, ">="); }
+
+
+lval* builtin_head(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1,
+          "Function 'head' passed too many arguments. ",
+          "Got %i, expected %i",
+          val->count, 1);
+  LASSERT(val, lval_type_of(val->cell[0]) == LVAL_QEXPR,
+          "Function 'head' passed incorrect type for argument 0"
+          "Got %s, Expected %s",
+          ltype_name(lval_type_of(val->cell[0])), ltype_name(LVAL_QEXPR));
+  LASSERT(val, val->cell[0]->count != 0,
+          "Function 'head' passed '{}'");
+
+  /* a fresh list, so the result doesn't keep the whole argument alive */
+  lval* list = lval_take(val, 0);
+  lval* result = lval_add(lval_qexpr(), lval_ref(list->cell[0]));
+  lval_del(list);
+
+  return result;
+}
+
+lval* builtin_tail(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1,
+          "Function 'tail' passed too many arguments");
+  LASSERT(val, lval_type_of(val->cell[0]) == LVAL_QEXPR,
+          "Function 'tail' passed incorrect type");
+  LASSERT(val, val->cell[0]->count != 0,
+          "Function 'tail' passed '{}'");
+
+  lval* result = lval_unshare(lval_take(val, 0));
+  lval_del(lval_pop(result, 0));
+
+  return result;
+}
+
+lval* builtin_list(lenv* env, lval* val) {
+  val->type = LVAL_QEXPR;
+  return val;
+}
+
+lval* builtin_eval(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1,
+          "Function 'eval' passed too many arguments");
+  LASSERT(val, lval_type_of(val->cell[0]) == LVAL_QEXPR,
+          "Function 'eval' passed incorrect type");
+
+  return lval_run_quoted(env, lcaller, lval_take(val, 0));
+}
+
+/*
+ * left followed by right; consumes both. Whichever side fits into the
+ * other's free slots gets copied there, so e.g. consing onto a list that
+ * was itself built by consing only ever copies the new element.
+ */
+lval* lval_join(lval* left, lval* right) {
+  if (right->count == 0) { lval_del(right); return left; }
+  if (left->count == 0) {
+    right = lval_unshare(right);
+    right->type = left->type;
+    lval_del(left);
+    return right;
+  }
+
+  lcells* lc = lval_cells(left);
+  lcells* rc = lval_cells(right);
+  int prepend = right->front == rc->lo && rc->lo >= left->count;
+  int append = left->front + left->count == lc->hi
+    && lc->hi + right->count <= lc->capacity;
+
+  if (prepend && (!append || left->count <= right->count)) {
+    right = lval_unshare(right);
+    for (int i = left->count - 1; i >= 0; i--) {
+      rc->items[--rc->lo] = lval_ref(left->cell[i]);
+    }
+    lval_set_cells(right, rc, rc->lo, right->count + left->count);
+    right->type = left->type;
+    lval_del(left);
+    return right;
+  }
+
+  left = lval_unshare(left);
+  if (!append) {
+    /* leave as much room in front as behind, for further joins */
+    int total = left->count + right->count;
+    lval_copy_cells(left, total * 2, total / 2);
+  }
+  for (int i = 0; i < right->count; i++) {
+    lval_add(left, lval_ref(right->cell[i]));
+  }
+  lval_del(right);
+  return left;
+}
+lval* builtin_join(lenv* env, lval* val) {
+  for (int i = 0; i < val->count; i++) {
+    LASSERT(val, lval_type_of(val->cell[i]) == LVAL_QEXPR,
+            "Function 'join' passed incorrect type");
+  }
+
+  lval* result = lval_pop(val, 0);
+
+  while (val->count) {
+    result = lval_join(result, lval_pop(val, 0));
+  }
+
+  lval_del(val);
+  return result;
+}
+
+lval* builtin_cons(lenv* env, lval* val) {
+  LASSERT(val, val->count == 2,
+          "Function 'cons' passed incorrect number of arguments");
+  LASSERT(val, lval_type_of(val->cell[1]) == LVAL_QEXPR,
+          "Function 'cons' passed incorrect type");
+
+  lval* first = lval_pop(val, 0);
+  lval* rest = lval_take(val, 0);
+  return lval_join(lval_add(lval_qexpr(), first), rest);
+}
+
+lval* builtin_def(lenv* env, lval* val) {
+  LASSERT(val, lval_type_of(val->cell[0]) == LVAL_QEXPR,
+          "Function 'def' passed incorrect type");
+
+  lval* syms = val->cell[0];
+  for (int i = 0; i < syms->count; i++) {
+    LASSERT(val, lval_type_of(syms->cell[i]) == LVAL_SYM,
+            "Function 'def' given a non-symbol");
+  }
+
+  LASSERT(val, syms->count == val->count - 1,
+          "Function 'def' given incorrect number of arguments");
+
+  for (int i = 0; i < syms->count; i++) {
+    lenv_put(env, syms->cell[i], val->cell[i + 1]);
+  }
+
+  lval_del(val);
+  return lval_sexpr();
+}
+
+
+/*
+ * User functions. Closures are flat: when a lambda is made, every symbol
+ * in its body that names a local of the frame it is made in has that
+ * local's value copied into the lambda. Calling it binds the arguments
+ * into a new lframe, and the body finds each variable either there or
+ * among the captured values, one step away however deeply it is nested.
+ * A closure keeps only what it uses alive, never the frames around it.
+ */
+
+/* count empty slots */
+lframe* lframe_new(int count) {
+  lframe* frame = malloc(sizeof(lframe) + sizeof(lval*) * count);
+  frame->refs = 1;
+  frame->count = count;
+  frame->fn = NULL;
+  frame->free = NULL;
+  for (int i = 0; i < count; i++) { frame->slots[i] = NULL; }
+  return frame;
+}
+
+void lframe_release(lframe* frame) {
+  if (!frame || --frame->refs > 0) { return; }
+
+  for (int i = 0; i < frame->count; i++) {
+    if (frame->slots[i]) { lval_del(frame->slots[i]); }
+  }
+  if (frame->fn) { lval_del(frame->fn); }
+  free(frame);
+}
+
+/* the index of name in scope, which may be NULL, or -1 */
+int lscope_find(lscope* scope, char* name) {
+  if (!scope) { return -1; }
+
+  /* the last binding wins, as it would for repeated def */
+  for (int i = scope->count - 1; i >= 0; i--) {
+    if (scope->names[i] == name) { return i; }
+  }
+  return -1;
+}
+
+/* where sym is bound for the body frame is running, or NULL */
+lval** lframe_find(lframe* frame, lval* sym) {
+  if (!frame || !frame->fn) { return NULL; }
+
+  lscope* scope = &frame->fn->lambda->scope;
+  int i = lscope_find(scope, lval_sym_of(sym));
+  if (i < 0) { return NULL; }
+  return i < scope->locals
+    ? &frame->slots[i] : &frame->free[i - scope->locals];
+}
+
+/*
+ * Captures the free variables of lambda's body from frame: any symbol,
+ * however deep in the body, that isn't one of the formals and that frame
+ * can see. That includes those of lambdas nested in the body, which will
+ * be made in frames of this one and capture from it in turn.
+ */
+void llambda_capture(llambda* lambda, lframe* frame) {
+  lscope* scope = &lambda->scope;
+  lstack pending = { 0 };
+
+  lstack_push(&pending, lambda->body);
+  while (pending.count > 0) {
+    lval* list = lstack_pop(&pending);
+    for (int i = 0; i < list->count; i++) {
+      lval* item = list->cell[i];
+      int type = lval_type_of(item);
+      if (type == LVAL_SEXPR || type == LVAL_QEXPR) {
+        lstack_push(&pending, item);
+        continue;
+      }
+      if (type != LVAL_SYM
+          || lscope_find(scope, lval_sym_of(item)) >= 0) {
+        continue;
+      }
+
+      lval** value = lframe_find(frame, item);
+      if (!value) { continue; }
+
+      int n = scope->count - scope->locals;
+      scope->names = realloc(scope->names, sizeof(char*) * (scope->count + 1));
+      scope->names[scope->count++] = lval_sym_of(item);
+      lambda->captured = realloc(lambda->captured, sizeof(lval*) * (n + 1));
+      lambda->captured[n] = lval_ref(*value);
+    }
+  }
+
+  free(pending.items);
+}
+
+/*
+ * A frame for calling the lambda fn with count arguments; consumes fn and
+ * each of args, but not the array. NULL with *err set if the count is wrong.
+ */
+lframe* lframe_bind(lval* fn, lval** args, int count, lval** err) {
+  llambda* lambda = fn->lambda;
+  int fixed = lambda->scope.locals - lambda->variadic;
+
+  if (count < fixed || (!lambda->variadic && count > fixed)) {
+    *err = lval_err("Function passed %i arguments, expected %s%i",
+                    count, lambda->variadic ? "at least " : "", fixed);
+    for (int i = 0; i < count; i++) { lval_del(args[i]); }
+    lval_del(fn);
+    return NULL;
+  }
+
+  lframe* frame = lframe_new(lambda->scope.locals);
+  frame->fn = fn;
+  frame->free = lambda->captured;
+  for (int i = 0; i < fixed; i++) { frame->slots[i] = args[i]; }
+
+  if (lambda->variadic) {
+    lval* rest = lval_qexpr();
+    lval_reserve(rest, count - fixed);
+    for (int i = fixed; i < count; i++) { lval_add(rest, args[i]); }
+    frame->slots[fixed] = rest;
+  }
+
+  return frame;
+}
+
+/* the same, for the arguments in the list args */
+lframe* lframe_bind_list(lval* fn, lval* args, lval** err) {
+  for (int i = 0; i < args->count; i++) { lval_ref(args->cell[i]); }
+  lframe* frame = lframe_bind(fn, args->cell, args->count, err);
+  lval_del(args);
+  return frame;
+}
+
+/* a lambda closing over frame, checking its formals; consumes both */
+lval* lval_close(lval* formals, lval* body, lframe* frame) {
+  lval* err = NULL;
+
+  if (lval_type_of(formals) == LVAL_ERR) {
+    err = lval_ref(formals);
+  } else if (lval_type_of(body) == LVAL_ERR) {
+    err = lval_ref(body);
+  } else if (lval_type_of(formals) != LVAL_QEXPR
+             || lval_type_of(body) != LVAL_QEXPR) {
+    err = lval_err("Function '\\' passed incorrect type");
+  } else {
+    for (int i = 0; i < formals->count && !err; i++) {
+      lval* formal = formals->cell[i];
+      if (lval_type_of(formal) != LVAL_SYM) {
+        err = lval_err("Cannot define non-symbol");
+      } else if (lval_is_keyword(formal, keywords.rest)
+                 && i != formals->count - 2) {
+        err = lval_err("Function format invalid. "
+                       "Symbol '&' not followed by single symbol.");
+      }
+    }
+  }
+
+  if (err) {
+    lval_del(formals);
+    lval_del(body);
+    return err;
+  }
+
+  lval* val = lval_lambda(formals, body);
+  if (frame) { llambda_capture(val->lambda, frame); }
+  return val;
+}
+
+lval* builtin_lambda(lenv* env, lval* val) {
+  LASSERT(val, val->count == 2,
+          "Function '\\' passed %i arguments, expected 2", val->count);
+
+  lval* formals = lval_pop(val, 0);
+  lval* body = lval_take(val, 0);
+  return lval_close(formals, body, NULL);
+}
+
+/* only reached when the branches aren't written out, see lval_eval;
+   the chosen one runs with the caller's locals, like eval */
+lval* builtin_if(lenv* env, lval* val) {
+  LASSERT(val, val->count == 3,
+          "Function 'if' passed %i arguments, expected 3", val->count);
+  LASSERT(val, lval_is_number(val->cell[0])
+          && lval_type_of(val->cell[1]) == LVAL_QEXPR
+          && lval_type_of(val->cell[2]) == LVAL_QEXPR,
+          "Function 'if' passed incorrect type");
+
+  lval* branch = lval_pop(val, lval_is_true(val->cell[0]) ? 1 : 2);
+  lval_del(val);
+  return lval_run_quoted(env, lcaller, branch);
+}
+
+lval* lmemo_call(lenv* env, lval* fn, lval* args);
+lval* lmemo_recall(lval* fn, lval* args);
+lval* lmemo_apply(lenv* env, lval* fn, lval* args);
+void lmemo_store(lval* fn, lval* key, lval* result);
+lval* lmemo_fn(lval* fn);
+
+/* apply an evaluated function to its evaluated arguments; consumes both */
+lval* lval_call(lenv* env, lval* first, lval* args) {
+  /* ensure that the first val is a function */
+  if (lval_type_of(first) != LVAL_FUN) {
+    lval_del(first);
+    lval_del(args);
+    return lval_err("S-expr does not start with a function");
+  }
+
+  if (lval_is_memo(first)) { return lmemo_call(env, first, args); }
+
+  if (lval_is_lambda(first)) {
+    lval* err;
+    lframe* frame = lframe_bind_list(first, args, &err);
+    if (!frame) { return err; }
+    if (!vm_disabled) {
+      return lvm_run(env, llambda_code(first->lambda), frame);
+    }
+
+    lval* result = lval_eval(env, frame, lval_unquote(first->lambda->body));
+    lframe_release(frame);
+    return result;
+  }
+
+  lval* result = lval_fun_of(first)(env, args);
+  lval_del(first);
+  return result;
+}
+
+/*
+ * (if c {a} {b}) and (\ formals body) are special forms in both
+ * evaluators, unless a local shadows the keyword: a lambda has to close
+ * over the frame it is made in, and a branch of an if in tail position
+ * is in tail position too. An if whose branches aren't written out as
+ * Q-expressions is left to builtin_if.
+ */
+int lval_is_form(lval* val, char* keyword, int count) {
+  if (val->count != count || !lval_is_keyword(val->cell[0], keyword)) {
+    return 0;
+  }
+  if (keyword != keywords.cond) { return 1; }
+  return lval_type_of(val->cell[2]) == LVAL_QEXPR
+    && lval_type_of(val->cell[3]) == LVAL_QEXPR;
+}
+
+enum { LFORM_CALL, LFORM_IF, LFORM_LAMBDA, LFORM_MEMO };
+
+/*
+ * An S-expression lval_eval is partway through: vals holds the values of
+ * the cells evaluated so far, which for a call is all of them and for the
+ * forms all but the keyword (and for if, only the condition). An
+ * LFORM_MEMO task instead waits for the value of a call to the lambda
+ * behind the memo function expr, to file it under the arguments in vals.
+ */
+typedef struct {
+  int form;
+  lval* expr;
+  lval* vals;
+  lframe* frame;
+} ltask;
+
+/* shared by nested runs of lval_eval, like the VM's stack */
+struct {
+  int count;
+  int capacity;
+  ltask* items;
+} ltasks;
+
+ltask* ltasks_push(void) {
+  if (ltasks.count == ltasks.capacity) {
+    ltasks.capacity = ltasks.capacity ? ltasks.capacity * 2 : 64;
+    ltasks.items = realloc(ltasks.items, sizeof(ltask) * ltasks.capacity);
+  }
+  return &ltasks.items[ltasks.count++];
+}
+
+int ltask_needs(ltask* task) {
+  switch (task->form) {
+    case LFORM_IF: return 1;
+    case LFORM_LAMBDA: return 2;
+    default: return task->expr->count;
+  }
+}
+
+/*
+ * Evaluates val with the locals of frame, which may be NULL at the top
+ * level; consumes val but not frame.
+ *
+ * Nothing recurses on the C stack. An S-expression whose cells need
+ * evaluating goes on ltasks while they are, and a finished value is
+ * handed to the innermost task, which either starts on its next cell or
+ * is done and applies itself. A call to a lambda replaces val with the
+ * body and frame with the callee's, without a task of its own, so a call
+ * in tail position doesn't grow ltasks either.
+ */
+lval* lval_eval(lenv* env, lframe* frame, lval* val) {
+  if (ldepth.nested >= LDEPTH_C_MAX) {
+    lval_del(val);
+    return ldepth_err(
+      lval_err("Evaluation nested more than %i deep", LDEPTH_C_MAX));
+  }
+  ldepth.nested++;
+
+  /* a tail call drops the frame it leaves, so hold one of our own */
+  if (frame) { frame->refs++; }
+  int base = ltasks.count;
+  lval* result = NULL;
+
+  for (;;) {
+    /* go down to a value, pushing the S-expressions on the way */
+    while (!result) {
+      if (lval_type_of(val) == LVAL_SYM) {
+        lval** local = lframe_find(frame, val);
+        result = local ? lval_ref(*local) : lenv_get(env, val);
+        lval_del(val);
+        continue;
+      }
+      if (lval_type_of(val) != LVAL_SEXPR || val->count == 0) {
+        result = val;
+        continue;
+      }
+
+      /* a single expr is just that expr */
+      if (val->count == 1) {
+        val = lval_take(val, 0);
+        continue;
+      }
+
+      if (ltasks.count >= ldepth.max) {
+        lval_del(val);
+        result = ldepth_err(
+          lval_err("Maximum depth of %li exceeded", ldepth.max));
+        continue;
+      }
+
+      int form = LFORM_CALL;
+      if (lval_is_form(val, keywords.cond, 4)) { form = LFORM_IF; }
+      if (lval_is_form(val, keywords.lambda, 3)) { form = LFORM_LAMBDA; }
+      if (form != LFORM_CALL && lframe_find(frame, val->cell[0])) {
+        form = LFORM_CALL;
+      }
+
+      ltask* task = ltasks_push();
+      task->form = form;
+      task->expr = val;
+      task->vals = lval_sexpr();
+      task->frame = frame;
+      if (frame) { frame->refs++; }
+
+      lval_reserve(task->vals, ltask_needs(task));
+      val = lval_ref(val->cell[form == LFORM_CALL ? 0 : 1]);
+    }
+
+    /* past a depth limit, the tasks this run pushed are dropped */
+    while (ldepth.exceeded && ltasks.count > base) {
+      ltask* task = &ltasks.items[--ltasks.count];
+      lval_del(task->expr);
+      lval_del(task->vals);
+      lframe_release(task->frame);
+    }
+    if (ltasks.count == base) { break; }
+
+    /* hand the value up to the innermost task */
+    ltask* task = &ltasks.items[ltasks.count - 1];
+    if (task->form == LFORM_MEMO) {
+      lmemo_store(task->expr, task->vals, result);
+      ltasks.count--;
+      lframe_release(frame);
+      frame = task->frame;
+      continue;
+    }
+    lval_add(task->vals, result);
+    result = NULL;
+    lframe_release(frame);
+
+    if (task->vals->count < ltask_needs(task)) {
+      int first = task->form == LFORM_CALL ? 0 : 1;
+      frame = task->frame;
+      if (frame) { frame->refs++; }
+      val = lval_ref(task->expr->cell[first + task->vals->count]);
+      continue;
+    }
+
+    /* the task is done; whatever it leads to runs in its place */
+    ltask done = *task;
+    ltasks.count--;
+    frame = done.frame;
+
+    if (done.form == LFORM_LAMBDA) {
+      lval* formals = lval_pop(done.vals, 0);
+      lval* body = lval_take(done.vals, 0);
+      lval_del(done.expr);
+      result = lval_close(formals, body, frame);
+      continue;
+    }
+
+    if (done.form == LFORM_IF) {
+      lval* cond = done.vals->cell[0];
+      if (!lval_is_number(cond)) {
+        result = lval_type_of(cond) == LVAL_ERR
+          ? lval_ref(cond) : lval_err("Function 'if' passed incorrect type");
+      } else {
+        val = lval_unquote(done.expr->cell[lval_is_true(cond) ? 2 : 3]);
+      }
+      lval_del(done.vals);
+      lval_del(done.expr);
+      continue;
+    }
+
+    lval_del(done.expr);
+    val = done.vals;
+    for (int i = 0; !result && i < val->count; i++) {
+      if (lval_type_of(val->cell[i]) == LVAL_ERR) {
+        result = lval_take(val, i);
+      }
+    }
+    if (result) { continue; }
+
+    lval* first = lval_pop(val, 0);
+    if (lval_is_memo(first)) {
+      result = lmemo_recall(first, val);
+      lval* fn = lmemo_fn(first);
+      if (result) {
+        lval_del(first);
+        lval_del(val);
+        continue;
+      }
+      if (!lval_is_lambda(fn) || fn->lambda->memo) {
+        lcaller = frame;
+        result = lmemo_apply(env, first, val);
+        continue;
+      }
+      if (ltasks.count >= ldepth.max) {
+        lval_del(first);
+        lval_del(val);
+        result = ldepth_err(
+          lval_err("Maximum depth of %li exceeded", ldepth.max));
+        continue;
+      }
+
+      /* the task takes over our frame, val becomes the key */
+      lframe* callee = lframe_bind_list(lval_ref(fn), lval_ref(val), &result);
+      if (!callee) {
+        lval_del(first);
+        lval_del(val);
+        continue;
+      }
+      ltask* task = ltasks_push();
+      task->form = LFORM_MEMO;
+      task->expr = first;
+      task->vals = val;
+      task->frame = frame;
+      frame = callee;
+      val = lval_unquote(fn->lambda->body);
+      continue;
+    }
+    if (!lval_is_lambda(first)) {
+      lcaller = frame;
+      result = lval_call(env, first, val);
+      continue;
+    }
+
+    lframe* callee = lframe_bind_list(first, val, &result);
+    if (!callee) { continue; }
+    lframe_release(frame);
+    frame = callee;
+    val = lval_unquote(first->lambda->body);
+  }
+
+  lframe_release(frame);
+  ldepth_leave();
+  return result;
+}
+
+
+// Memo
+
+/*
+ * (memo f) is f with its results remembered, keyed on its arguments, in
+ * a table of up to 1024 of them, or (memo f n) of up to n. When it is
+ * full the least recently used result makes way. Keys are compared
+ * exactly, type and all, since f may well tell 1 from 1.0, and errors
+ * are never remembered. (memo-stats m) gives {hits misses count capacity}.
+ *
+ * When f is a lambda, both evaluators run it like any other call and
+ * file its result on the way back out: lvm_run through a call record
+ * that carries the key, lval_eval through an LFORM_MEMO task. So a memo
+ * function that recurses through itself, like a memoized fib, is limited
+ * by --max-depth rather than by the C stack.
+ */
+
+#define LMEMO_CAPACITY 1024
+
+typedef struct {
+  lval* args;
+  lval* result;
+  unsigned long hash;
+  int chain; /* the next entry in the same bucket, or -1 */
+  int newer; /* the entries used just after and before this one, or -1 */
+  int older;
+} lmemo_entry;
+
+typedef struct lmemo {
+  lval* fn;
+  int capacity;
+  int count;
+  lmemo_entry* entries; /* room for count, growing up to capacity */
+  int entry_capacity;
+  int* buckets;         /* a power of two of them, at least count */
+  int bucket_count;
+  int newest;
+  int oldest;
+  unsigned long hits;
+  unsigned long misses;
+} lmemo;
+
+unsigned long lhash_mix(unsigned long hash, unsigned long x) {
+  return (hash ^ x) * 0x100000001b3UL;
+}
+
+/* a hash of val's structure that agrees with lval_same */
+unsigned long lval_hash(lval* val) {
+  unsigned long hash = 0xcbf29ce484222325UL;
+  lstack pending = { 0 };
+  lstack_push(&pending, val);
+
+  while (pending.count > 0) {
+    val = lstack_pop(&pending);
+    hash = lhash_mix(hash, lval_type_of(val));
+
+    switch (lval_type_of(val)) {
+      case LVAL_NUM: hash = lhash_mix(hash, lval_num_of(val)); break;
+      case LVAL_DBL: {
+        double x = lval_dbl_of(val);
+        unsigned long bits;
+        memcpy(&bits, &x, sizeof(bits));
+        hash = lhash_mix(hash, bits);
+        break;
+      }
+      case LVAL_BIG:
+        hash = lhash_mix(hash, val->sign);
+        for (int i = 0; i < val->size; i++) {
+          hash = lhash_mix(hash, val->digits[i]);
+        }
+        break;
+      case LVAL_ERR:
+        for (char* c = val->err; *c; c++) { hash = lhash_mix(hash, *c); }
+        break;
+      case LVAL_SYM: hash = lhash_mix(hash, (uintptr_t)val); break;
+      case LVAL_FUN:
+        hash = lhash_mix(hash, lval_is_builtin(val)
+                         ? (uintptr_t)val : (uintptr_t)val->lambda);
+        break;
+      case LVAL_VEC: {
+        int reals = lval_vec_of(val)->reals;
+        hash = lhash_mix(hash, reals);
+        for (int i = 0; i < val->count; i++) {
+          unsigned long bits = val->nums[i];
+          if (reals) { memcpy(&bits, &val->reals[i], sizeof(bits)); }
+          hash = lhash_mix(hash, bits);
+        }
+        break;
+      }
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+        hash = lhash_mix(hash, val->count);
+        for (int i = val->count - 1; i >= 0; i--) {
+          lstack_push(&pending, val->cell[i]);
+        }
+        break;
+    }
+  }
+
+  free(pending.items);
+  return hash;
+}
+
+/* x and y on their own are the same value, not merely equal numbers */
+int lval_same_one(lval* x, lval* y) {
+  if (lval_type_of(x) != lval_type_of(y)) { return 0; }
+
+  switch (lval_type_of(x)) {
+    case LVAL_NUM: return lval_num_of(x) == lval_num_of(y);
+    case LVAL_DBL: {
+      double a = lval_dbl_of(x);
+      double b = lval_dbl_of(y);
+      return memcmp(&a, &b, sizeof(double)) == 0;
+    }
+    case LVAL_FUN:
+      if (lval_is_builtin(x) || lval_is_builtin(y)) { return x == y; }
+      return x->lambda == y->lambda;
+    case LVAL_VEC:
+      return lval_vec_of(x)->reals == lval_vec_of(y)->reals
+        && lval_eq_one(x, y);
+    default: return lval_eq_one(x, y);
+  }
+}
+
+/* like lval_eq, but with numbers compared by type as well as value */
+int lval_same(lval* x, lval* y) {
+  lstack pairs = { 0 };
+  int same = 1;
+
+  lstack_push(&pairs, x);
+  lstack_push(&pairs, y);
+  while (same && pairs.count > 0) {
+    y = lstack_pop(&pairs);
+    x = lstack_pop(&pairs);
+    same = lval_same_one(x, y);
+
+    if (same && (lval_type_of(x) == LVAL_SEXPR
+                 || lval_type_of(x) == LVAL_QEXPR)) {
+      for (int i = x->count - 1; i >= 0; i--) {
+        lstack_push(&pairs, x->cell[i]);
+        lstack_push(&pairs, y->cell[i]);
+      }
+    }
+  }
+
+  free(pairs.items);
+  return same;
+}
+
+/* takes over fn */
+lmemo* lmemo_new(lval* fn, int capacity) {
+  lmemo* memo = malloc(sizeof(lmemo));
+  memo->fn = fn;
+  memo->capacity = capacity;
+  memo->count = 0;
+  memo->entries = NULL;
+  memo->entry_capacity = 0;
+  memo->buckets = NULL;
+  memo->bucket_count = 0;
+  memo->newest = -1;
+  memo->oldest = -1;
+  memo->hits = 0;
+  memo->misses = 0;
+  return memo;
+}
+
+void lmemo_del(lmemo* memo) {
+  lval_del(memo->fn);
+  for (int i = 0; i < memo->count; i++) {
+    lval_del(memo->entries[i].args);
+    lval_del(memo->entries[i].result);
+  }
+  free(memo->entries);
+  free(memo->buckets);
+  free(memo);
+}
+
+int* lmemo_bucket(lmemo* memo, unsigned long hash) {
+  return &memo->buckets[(hash ^ hash >> 32) & (memo->bucket_count - 1)];
+}
+
+/* the index of the entry for args, or -1 */
+int lmemo_find(lmemo* memo, lval* args, unsigned long hash) {
+  if (memo->bucket_count == 0) { return -1; }
+
+  for (int i = *lmemo_bucket(memo, hash); i >= 0;
+       i = memo->entries[i].chain) {
+    if (memo->entries[i].hash == hash
+        && lval_same(memo->entries[i].args, args)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* take entry i out of the order of use */
+void lmemo_unlink(lmemo* memo, int i) {
+  lmemo_entry* entry = &memo->entries[i];
+  if (entry->newer >= 0) {
+    memo->entries[entry->newer].older = entry->older;
+  } else {
+    memo->newest = entry->older;
+  }
+  if (entry->older >= 0) {
+    memo->entries[entry->older].newer = entry->newer;
+  } else {
+    memo->oldest = entry->newer;
+  }
+}
+
+/* make entry i the most recently used */
+void lmemo_touch(lmemo* memo, int i) {
+  lmemo_entry* entry = &memo->entries[i];
+  entry->newer = -1;
+  entry->older = memo->newest;
+  if (memo->newest >= 0) { memo->entries[memo->newest].newer = i; }
+  memo->newest = i;
+  if (memo->oldest < 0) { memo->oldest = i; }
+}
+
+/* double the buckets and rechain every entry into them */
+void lmemo_grow(lmemo* memo) {
+  memo->bucket_count = memo->bucket_count ? memo->bucket_count * 2 : 16;
+  memo->buckets = realloc(memo->buckets, sizeof(int) * memo->bucket_count);
+  for (int i = 0; i < memo->bucket_count; i++) { memo->buckets[i] = -1; }
+
+  for (int i = 0; i < memo->count; i++) {
+    int* bucket = lmemo_bucket(memo, memo->entries[i].hash);
+    memo->entries[i].chain = *bucket;
+    *bucket = i;
+  }
+}
+
+/* remembers result for args, evicting the oldest entry when full;
+   consumes both */
+void lmemo_put(lmemo* memo, lval* args, unsigned long hash, lval* result) {
+  int i;
+  if (memo->count == memo->capacity) {
+    /* reuse the least recently used entry, after unchaining it */
+    i = memo->oldest;
+    int* link = lmemo_bucket(memo, memo->entries[i].hash);
+    while (*link != i) { link = &memo->entries[*link].chain; }
+    *link = memo->entries[i].chain;
+    lmemo_unlink(memo, i);
+    lval_del(memo->entries[i].args);
+    lval_del(memo->entries[i].result);
+  } else {
+    if (memo->count == memo->entry_capacity) {
+      memo->entry_capacity = memo->entry_capacity
+        ? memo->entry_capacity * 2 : 16;
+      if (memo->entry_capacity > memo->capacity) {
+        memo->entry_capacity = memo->capacity;
+      }
+      memo->entries = realloc(memo->entries,
+                              sizeof(lmemo_entry) * memo->entry_capacity);
+    }
+    /* before the new entry counts, so it isn't rechained unset */
+    if (memo->count == memo->bucket_count) { lmemo_grow(memo); }
+    i = memo->count++;
+  }
+
+  /* they outlive the call, like a def, so they are kept in the old space */
+  lmemo_entry* entry = &memo->entries[i];
+  entry->args = lval_promote(args);
+  entry->result = lval_promote(result);
+  entry->hash = hash;
+  int* bucket = lmemo_bucket(memo, hash);
+  entry->chain = *bucket;
+  *bucket = i;
+  lmemo_touch(memo, i);
+}
+
+/* the function the memo function fn remembers the results of */
+lval* lmemo_fn(lval* fn) {
+  return fn->lambda->memo->fn;
+}
+
+/* the memo function fn's result for args if it has one, or NULL;
+   counts the hit or miss but consumes neither */
+lval* lmemo_recall(lval* fn, lval* args) {
+  lmemo* memo = fn->lambda->memo;
+  int i = lmemo_find(memo, args, lval_hash(args));
+  if (i < 0) {
+    memo->misses++;
+    return NULL;
+  }
+
+  memo->hits++;
+  lmemo_unlink(memo, i);
+  lmemo_touch(memo, i);
+  return lval_ref(memo->entries[i].result);
+}
+
+/* files result under key, unless it is an error or the call that made it
+   already did; consumes fn and key but not result */
+void lmemo_store(lval* fn, lval* key, lval* result) {
+  lmemo* memo = fn->lambda->memo;
+  unsigned long hash = lval_hash(key);
+  if (lval_type_of(result) != LVAL_ERR && lmemo_find(memo, key, hash) < 0) {
+    lmemo_put(memo, key, hash, lval_ref(result));
+  } else {
+    lval_del(key);
+  }
+  lval_del(fn);
+}
+
+/*
+ * A memo function whose result isn't remembered yet, applied the slow way
+ * with lval_call; consumes both. lvm_run and lval_eval only come here when
+ * memo->fn isn't a lambda they can run themselves.
+ */
+lval* lmemo_apply(lenv* env, lval* fn, lval* args) {
+  /* a key of our own, since a builtin may take its arguments apart */
+  lval* key = lval_sexpr();
+  lval_reserve(key, args->count);
+  for (int j = 0; j < args->count; j++) {
+    lval_add(key, lval_ref(args->cell[j]));
+  }
+
+  lval* result = lval_call(env, lval_ref(lmemo_fn(fn)), args);
+  lmemo_store(fn, key, result);
+  return result;
+}
+
+/* apply a memo function to its evaluated arguments; consumes both */
+lval* lmemo_call(lenv* env, lval* fn, lval* args) {
+  lval* result = lmemo_recall(fn, args);
+  if (!result) { return lmemo_apply(env, fn, args); }
+
+  lval_del(args);
+  lval_del(fn);
+  return result;
+}
+
+lval* builtin_memo(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1 || val->count == 2,
+          "Function 'memo' passed %i arguments, expected 1 or 2",
+          val->count);
+  LASSERT(val, lval_type_of(val->cell[0]) == LVAL_FUN
+          && (val->count == 1 || lval_type_of(val->cell[1]) == LVAL_NUM),
+          "Function 'memo' passed incorrect type");
+
+  long capacity = LMEMO_CAPACITY;
+  if (val->count == 2) {
+    capacity = lval_num_of(val->cell[1]);
+    LASSERT(val, capacity > 0 && capacity <= INT_MAX / 2,
+            "Function 'memo' passed capacity %li", capacity);
+  }
+
+  lval* fn = lval_pop(val, 0);
+  lval_del(val);
+
+  lval* result = lval_lambda(lval_qexpr(), lval_qexpr());
+  result->lambda->memo = lmemo_new(lval_promote(fn), capacity);
+  return result;
+}
+
+lval* builtin_memo_stats(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1,
+          "Function 'memo-stats' passed %i arguments, expected 1",
+          val->count);
+  LASSERT(val, lval_is_memo(val->cell[0]),
+          "Function 'memo-stats' passed incorrect type");
+
+  lmemo* memo = val->cell[0]->lambda->memo;
+  lval* result = lval_qexpr();
+  lval_add(result, lval_num(memo->hits));
+  lval_add(result, lval_num(memo->misses));
+  lval_add(result, lval_num(memo->count));
+  lval_add(result, lval_num(memo->capacity));
+  lval_del(val);
+  return result;
+}
+
+
+// Fold
+
+/*
+ * A pass between reading a line and running it that replaces each call
+ * of a pure builtin on literal arguments with its value, e.g. '(* 60 60)'
+ * with 3600. It only folds code the line runs, in the order it runs it,
+ * so that each builtin is folded in as it will be bound at the time. The
+ * bodies of lambdas run later, when the symbols in them may be bound to
+ * something else, so they are left alone, and so is everything after a
+ * call of anything but a pure builtin, which might rebind one. --no-fold
+ * turns it off and --fold-stats reports how many calls each line folded.
+ */
+
+struct {
+  int enabled;
+  int verbose;
+  int blocked;  /* a call that might rebind a symbol has been passed */
+  long folded;  /* calls replaced in the current line */
+} lfold = { 1, 0, 0, 0 };
+
+/* the builtins whose result depends on nothing but their arguments */
+lbuiltin lfold_pure[] = {
+  builtin_list, builtin_head, builtin_tail, builtin_cons, builtin_join,
+  builtin_add, builtin_mul, builtin_sub, builtin_div,
+  builtin_eq, builtin_ne, builtin_lt, builtin_gt, builtin_le, builtin_ge,
+  builtin_vec, builtin_vlen, builtin_vsum, builtin_vmap_add, builtin_vdot,
+  builtin_vslice, builtin_sqrt, builtin_exp, builtin_log, builtin_pow,
+};
+
+/* the pure builtin the global sym is bound to, if that is what it is */
+lbuiltin lfold_builtin(lenv* env, lval* sym) {
+  if (!lval_is_sym(sym)) { return NULL; }
+
+  lentry* entry = lenv_entry(env, sym);
+  if (!entry || !lval_is_builtin(entry->val)) { return NULL; }
+
+  lbuiltin fun = lval_fun_of(entry->val);
+  int count = (int)(sizeof(lfold_pure) / sizeof(lbuiltin));
+  for (int i = 0; i < count; i++) {
+    if (lfold_pure[i] == fun) { return fun; }
+  }
+  return NULL;
+}
+
+/* val evaluates to itself */
+int lfold_is_literal(lval* val) {
+  switch (lval_type_of(val)) {
+    case LVAL_NUM: case LVAL_BIG: case LVAL_DBL: case LVAL_QEXPR:
+    case LVAL_VEC:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+lval* lfold_expr(lenv* env, lval* val);
+
+/*
+ * The Q-expression val folded as the S-expression it will be run as, or
+ * NULL if nothing in it folds. A branch that folds away entirely becomes
+ * '{value}', which runs as that value.
+ */
+lval* lfold_quoted(lenv* env, lval* val) {
+  lval* expr = lval_unquote(val);
+  lval* result = lfold_expr(env, expr);
+  lval_del(expr);
+
+  if (!result) { return NULL; }
+  if (lval_type_of(result) == LVAL_SEXPR) {
+    result->type = LVAL_QEXPR;
+    return result;
+  }
+  return lval_add(lval_qexpr(), result);
+}
+
+/*
+ * val folded, or NULL if nothing in it folds; doesn't take ownership of
+ * val. The read tree is no deeper than LDEPTH_C_MAX, so this recurses.
+ */
+lval* lfold_expr(lenv* env, lval* val) {
+  if (lval_type_of(val) != LVAL_SEXPR || val->count == 0) { return NULL; }
+  if (lval_is_form(val, keywords.lambda, 3)) { return NULL; }
+  int form_if = lval_is_form(val, keywords.cond, 4);
+
+  /* fold each cell that is run, keeping the originals until one changes;
+     only one branch of an if runs, so either may block what follows */
+  lval* result = NULL;
+  int blocked = lfold.blocked;
+  for (int i = 0; i < val->count; i++) {
+    lval* cell;
+    if (form_if && i >= 2) {
+      int before = lfold.blocked;
+      cell = lfold_quoted(env, val->cell[i]);
+      blocked = blocked || lfold.blocked;
+      lfold.blocked = before;
+    } else {
+      cell = lfold_expr(env, val->cell[i]);
+      blocked = lfold.blocked;
+    }
+
+    if (cell && !result) {
+      result = lval_sexpr();
+      for (int j = 0; j < i; j++) {
+        result = lval_add(result, lval_ref(val->cell[j]));
+      }
+    }
+    if (result) {
+      result = lval_add(result, cell ? cell : lval_ref(val->cell[i]));
+    }
+  }
+  lfold.blocked = blocked;
+
+  if (form_if || val->count < 2 || lfold.blocked) { return result; }
+
+  lval* call = result ? result : val;
+  lbuiltin fun = lfold_builtin(env, call->cell[0]);
+  if (!fun) {
+    lfold.blocked = 1;
+    return result;
+  }
+  for (int i = 1; i < call->count; i++) {
+    if (!lfold_is_literal(call->cell[i])) { return result; }
+  }
+
+  /* errors are left to happen when the line runs */
+  lval* args = lval_sexpr();
+  lval_reserve(args, call->count - 1);
+  for (int i = 1; i < call->count; i++) {
+    args = lval_add(args, lval_ref(call->cell[i]));
+  }
+  lval* value = fun(env, args);
+  if (!lfold_is_literal(value)) {
+    lval_del(value);
+    return result;
+  }
+
+  if (result) { lval_del(result); }
+  lfold.folded++;
+  return value;
+}
+
+/* val with everything that can be folded folded; consumes val */
+lval* lfold_line(lenv* env, lval* val) {
+  if (!lfold.enabled) { return val; }
+
+  lfold.folded = 0;
+  lfold.blocked = 0;
+  lval* result = lfold_expr(env, val);
+
+  if (lfold.verbose) {
+    fprintf(stderr, "fold: %li calls folded\n", lfold.folded);
+  }
+  if (!result) { return val; }
+  lval_del(val);
+  return result;
+}
+
+
+// Compile
+
+/*
+ * The bytecode compiler walks a read tree once and flattens it into a
+ * postfix program: every leaf is a push onto the VM's operand stack and
+ * every S-expression of two or more cells is a single OP_CALL. lval_eval
+ * stays as the reference tree-walker (see --tree-walk in main).
+ *
+ * Symbols are resolved while compiling. One that names a formal becomes
+ * an OP_LOCAL and one the lambda captured an OP_FREE, each reading a
+ * single slot; only the rest are left to OP_LOOKUP and the global
+ * environment.
+ *
+ * The special forms of lval_eval compile to jumps and OP_LAMBDA, and a
+ * call in tail position of a lambda's body to OP_TAIL_CALL, which the VM
+ * runs as a jump into the callee that reuses the caller's call record.
+ */
+
+typedef enum {
+  OP_CONST,   /* push a copy of consts[arg] */
+  OP_LOOKUP,  /* push the value bound to the symbol consts[arg] */
+  OP_LOCAL,   /* push the frame's slots[arg] */
+  OP_FREE,    /* push the frame's captured value free[arg] */
+  OP_CALL,    /* apply the top arg values as an evaluated S-expression */
+  OP_TAIL_CALL, /* OP_CALL and then OP_RETURN, without growing the stack */
+  OP_LAMBDA,  /* pop a body and formals, push a closure over the frame */
+  OP_JUMP,    /* continue at code[arg] */
+  OP_JUMP_FALSE, /* pop a condition, continue at code[arg] if it is false */
+  OP_RETURN   /* pop the result and leave the chunk */
+} lopcode;
+
+/*
+ * An OP_LOOKUP remembers the entry it last found and the environment and
+ * version it found it at, so running it again in an unchanged environment
+ * reads the value straight out of the entry without hashing or probing.
+ */
+typedef struct {
+  lenv* env;
+  unsigned long version;
+  lentry* entry;
+} lcache;
+
+typedef struct {
+  lopcode op;
+  int arg;
+  void* target; /* threaded dispatch address, filled in on first run */
+  lcache cache; /* OP_LOOKUP only */
+} linstr;
+
+typedef struct lchunk {
+  int count;
+  linstr* code;
+
+  int const_count;
+  lval** consts;
+
+  int threaded;
+  int depth; /* of lchunk_compile_expr's recursion, while compiling */
+
+  unsigned long calls; /* times the VM has entered it */
+  struct ljit* jit;    /* its native code, once it is hot */
+} lchunk;
+
+void lchunk_emit(lchunk* chunk, lopcode op, int arg) {
+  chunk->count++;
+  chunk->code = realloc(chunk->code, sizeof(linstr) * chunk->count);
+  chunk->code[chunk->count - 1].op = op;
+  chunk->code[chunk->count - 1].arg = arg;
+  chunk->code[chunk->count - 1].target = NULL;
+  chunk->code[chunk->count - 1].cache.env = NULL;
+}
+
+/* takes ownership of val; returns its index in the constant pool */
+int lchunk_const(lchunk* chunk, lval* val) {
+  chunk->const_count++;
+  chunk->consts = realloc(chunk->consts, sizeof(lval*) * chunk->const_count);
+  chunk->consts[chunk->const_count - 1] = val;
+  return chunk->const_count - 1;
+}
+
+void lchunk_compile_expr(lchunk* chunk, lval* val, lscope* scope, int tail);
+void lchunk_compile_node(lchunk* chunk, lval* val, lscope* scope, int tail);
+
+/* compiles the Q-expression val as if it were an S-expression */
+void lchunk_compile_quoted(lchunk* chunk, lval* val, lscope* scope, int tail) {
+  lval* expr = lval_unquote(val);
+  lchunk_compile_expr(chunk, expr, scope, tail);
+  lval_del(expr);
+}
+
+/* tail is set when val's value is what the chunk returns */
+void lchunk_compile_expr(lchunk* chunk, lval* val, lscope* scope, int tail) {
+  /* the compiler recurses, so past a point it compiles in the error */
+  if (chunk->depth >= LDEPTH_C_MAX) {
+    lval* err = lval_err("Expression nested more than %i deep", LDEPTH_C_MAX);
+    lchunk_emit(chunk, OP_CONST, lchunk_const(chunk, err));
+    return;
+  }
+
+  chunk->depth++;
+  lchunk_compile_node(chunk, val, scope, tail);
+  chunk->depth--;
+}
+
+void lchunk_compile_node(lchunk* chunk, lval* val, lscope* scope, int tail) {
+  switch (lval_type_of(val)) {
+    case LVAL_SYM: {
+      int i = lscope_find(scope, lval_sym_of(val));
+      if (i >= 0 && i < scope->locals) {
+        lchunk_emit(chunk, OP_LOCAL, i);
+        return;
+      }
+      if (i >= 0) {
+        lchunk_emit(chunk, OP_FREE, i - scope->locals);
+        return;
+      }
+      lchunk_emit(chunk, OP_LOOKUP, lchunk_const(chunk, lval_ref(val)));
+      return;
+    }
+
+    case LVAL_SEXPR:
+      /* mirrors lval_eval: '()' is itself and '(x)' is just x */
+      if (val->count == 0) { break; }
+      if (val->count == 1) {
+        lchunk_compile_expr(chunk, val->cell[0], scope, tail);
+        return;
+      }
+
+      if (lval_is_form(val, keywords.cond, 4)
+          && lscope_find(scope, lval_sym_of(val->cell[0])) < 0) {
+        lchunk_compile_expr(chunk, val->cell[1], scope, 0);
+        int branch = chunk->count;
+        lchunk_emit(chunk, OP_JUMP_FALSE, 0);
+        lchunk_compile_quoted(chunk, val->cell[2], scope, tail);
+        int jump = chunk->count;
+        lchunk_emit(chunk, OP_JUMP, 0);
+        chunk->code[branch].arg = chunk->count;
+        lchunk_compile_quoted(chunk, val->cell[3], scope, tail);
+        chunk->code[jump].arg = chunk->count;
+        return;
+      }
+
+      if (lval_is_form(val, keywords.lambda, 3)
+          && lscope_find(scope, lval_sym_of(val->cell[0])) < 0) {
+        lchunk_compile_expr(chunk, val->cell[1], scope, 0);
+        lchunk_compile_expr(chunk, val->cell[2], scope, 0);
+        lchunk_emit(chunk, OP_LAMBDA, 0);
+        return;
+      }
+
+      for (int i = 0; i < val->count; i++) {
+        lchunk_compile_expr(chunk, val->cell[i], scope, 0);
+      }
+      lchunk_emit(chunk, tail ? OP_TAIL_CALL : OP_CALL, val->count);
+      return;
+
+    default: break;
+  }
+
+  lchunk_emit(chunk, OP_CONST, lchunk_const(chunk, lval_ref(val)));
+}
+
+lchunk* lchunk_new(void) {
+  lchunk* chunk = malloc(sizeof(lchunk));
+  chunk->count = 0;
+  chunk->code = NULL;
+  chunk->const_count = 0;
+  chunk->consts = NULL;
+  chunk->threaded = 0;
+  chunk->depth = 0;
+  chunk->calls = 0;
+  chunk->jit = NULL;
+  return chunk;
+}
+
+/* does not take ownership of val; scope is NULL at the top level */
+lchunk* lchunk_compile(lval* val, lscope* scope) {
+  lchunk* chunk = lchunk_new();
+  lchunk_compile_expr(chunk, val, scope, 0);
+  lchunk_emit(chunk, OP_RETURN, 0);
+  return chunk;
+}
+
+/* the body of lambda, compiled the first time it is called */
+lchunk* llambda_code(llambda* lambda) {
+  if (!lambda->chunk) {
+    lambda->chunk = lchunk_new();
+    lchunk_compile_quoted(lambda->chunk, lambda->body, &lambda->scope, 1);
+    lchunk_emit(lambda->chunk, OP_RETURN, 0);
+  }
+  return lambda->chunk;
+}
+
+void ljit_del(struct ljit* jit);
+
+void lchunk_del(lchunk* chunk) {
+  for (int i = 0; i < chunk->const_count; i++) {
+    lval_del(chunk->consts[i]);
+  }
+
+  if (chunk->jit) { ljit_del(chunk->jit); }
+  free(chunk->consts);
+  free(chunk->code);
+  free(chunk);
+}
+
+
+// JIT
+
+/*
+ * A baseline compiler from bytecode to x86-64, for lambdas the VM enters
+ * often. Each instruction becomes the same work on the same operand stack
+ * and frame, so the interpreter can pick up from any instruction the
+ * native code stops at, and the native code can take over again at any
+ * instruction it compiled. Native code never calls out: pushes, jumps,
+ * cached global lookups and calls to '+', '-', '*' and the comparisons
+ * on two fixnums run inline, and anything else (a call to a lambda, a
+ * cache miss, an overflow, a number that isn't a fixnum) leaves it at
+ * that instruction for the interpreter to run.
+ *
+ * Those exits are either expected, like calls, or a guard failing. The
+ * code for a chunk whose guards keep failing is thrown away for good.
+ *
+ * Loops in lispy are tail calls, so counting entries to a chunk counts
+ * its back-edges too. --perf-map writes /tmp/perf-PID.map so perf can
+ * name the code it samples.
+ */
+
+/* where native code stopped: the operand stack top and exit << 1 | guard */
+typedef struct {
+  lval** sp;
+  long exit;
+} ljit_exit;
+
+typedef ljit_exit (*ljit_fn)(lval** sp, lframe* frame, lenv* env,
+                             void* start);
+
+typedef struct ljit {
+  ljit_fn enter;  /* NULL once the code has been thrown away */
+  unsigned char* code;
+  size_t size;
+  void** entries; /* each instruction's native code, NULL if it just exits */
+  int max_stack;  /* that the chunk's operands can grow by */
+  int deopts;
+} ljit;
+
+#define LJIT_MAX_DEOPTS 1000
+
+struct {
+  unsigned long threshold; /* entries before compiling; 0 never does */
+  int perf_map;
+  FILE* map;
+} jit = { 1000, 0, NULL };
+
+void ljit_discard(ljit* native) {
+#if LJIT
+  if (native->code) { munmap(native->code, native->size); }
+#endif
+  native->enter = NULL;
+  native->code = NULL;
+}
+
+void ljit_del(ljit* native) {
+  ljit_discard(native);
+  free(native->entries);
+  free(native);
+}
+
+#if LJIT
+
+/* machine code being assembled, and the rel32s still to patch */
+typedef struct {
+  int count;
+  int capacity;
+  unsigned char* bytes;
+
+  int fixup_count;
+  struct { int at; int target; }* fixups; /* an instruction, or ~exit */
+} lasm;
+
+void lasm_bytes(lasm* a, const char* bytes, int n) {
+  if (a->count + n > a->capacity) {
+    a->capacity = (a->count + n) * 2;
+    a->bytes = realloc(a->bytes, a->capacity);
+  }
+  memcpy(a->bytes + a->count, bytes, n);
+  a->count += n;
+}
+
+#define LASM(a, bytes) lasm_bytes((a), (bytes), sizeof(bytes) - 1)
+
+void lasm_u32(lasm* a, uint32_t x) { lasm_bytes(a, (char*)&x, 4); }
+void lasm_u64(lasm* a, uint64_t x) { lasm_bytes(a, (char*)&x, 8); }
+
+/* a jump or jcc whose rel32 goes to instruction target, or to ~target's
+   exit stub when target is negative */
+void lasm_jump(lasm* a, const char* op, int n, int target) {
+  lasm_bytes(a, op, n);
+  a->fixups = realloc(a->fixups, sizeof(*a->fixups) * (a->fixup_count + 1));
+  a->fixups[a->fixup_count].at = a->count;
+  a->fixups[a->fixup_count].target = target;
+  a->fixup_count++;
+  lasm_u32(a, 0);
+}
+
+#define LASM_JMP(a, target) lasm_jump((a), "\xe9", 1, (target))
+#define LASM_JNE(a, target) lasm_jump((a), "\x0f\x85", 2, (target))
+#define LASM_JE(a, target) lasm_jump((a), "\x0f\x84", 2, (target))
+#define LASM_JO(a, target) lasm_jump((a), "\x0f\x80", 2, (target))
+
+/* the exit stub target for leaving at instruction k */
+#define LJIT_EXIT(k, guard) (~((k) << 1 | (guard)))
+
+/*
+ * rbx is the operand stack top, r12 the frame and r14 the environment;
+ * rax, rcx and rdx are scratch. Pushes the value in rax, taking a
+ * reference to it if it is on the heap.
+ */
+void ljit_push_rax(lasm* a) {
+  LASM(a, "\xa8\x07");             /* test al, 7 */
+  LASM(a, "\x75\x03");             /* jnz +3 */
+  LASM(a, "\xff\x40");             /* inc dword [rax + refs] */
+  lasm_bytes(a, (char[]){ offsetof(lval, refs) }, 1);
+  LASM(a, "\x48\x89\x03");         /* mov [rbx], rax */
+  LASM(a, "\x48\x83\xc3\x08");     /* add rbx, 8 */
+}
+
+enum { LJIT_GENERIC, LJIT_ADD, LJIT_SUB, LJIT_MUL, LJIT_CMP };
+
+/* what a call to fn can be inlined as; *setcc is the condition for a
+   comparison */
+int ljit_op_of(lval* fn, char* setcc) {
+  if (!lval_is_builtin(fn)) { return LJIT_GENERIC; }
+  lbuiltin f = lval_fun_of(fn);
+  if (f == builtin_add) { return LJIT_ADD; }
+  if (f == builtin_sub) { return LJIT_SUB; }
+  if (f == builtin_mul) { return LJIT_MUL; }
+
+  if (f == builtin_eq) { *setcc = '\x94'; }
+  else if (f == builtin_ne) { *setcc = '\x95'; }
+  else if (f == builtin_lt) { *setcc = '\x9c'; }
+  else if (f == builtin_gt) { *setcc = '\x9f'; }
+  else if (f == builtin_le) { *setcc = '\x9e'; }
+  else if (f == builtin_ge) { *setcc = '\x9d'; }
+  else { return LJIT_GENERIC; }
+  return LJIT_CMP;
+}
+
+/*
+ * (f a b) for the builtin f the call's OP_LOOKUP last found, with the
+ * operands on the stack. Fixnums are tagged as 2n + 1, so adding,
+ * subtracting and comparing work on them almost as they are, and the
+ * overflow flag says when a result is no longer a fixnum.
+ */
+void ljit_binary(lasm* a, int k, lval* fn, int op, char setcc) {
+  LASM(a, "\x48\x8b\x43\xf0");     /* mov rax, [rbx - 16] */
+  LASM(a, "\x48\x8b\x4b\xf8");     /* mov rcx, [rbx - 8] */
+  LASM(a, "\x48\xba");             /* mov rdx, fn */
+  lasm_u64(a, (uintptr_t)fn);
+  LASM(a, "\x48\x3b\x53\xe8");     /* cmp rdx, [rbx - 24] */
+  LASM_JNE(a, LJIT_EXIT(k, 1));
+  LASM(a, "\x48\x89\xc2");         /* mov rdx, rax */
+  LASM(a, "\x48\x21\xca");         /* and rdx, rcx */
+  LASM(a, "\xf6\xc2\x01");         /* test dl, 1 */
+  LASM_JE(a, LJIT_EXIT(k, 1));
+
+  switch (op) {
+    case LJIT_ADD:
+      LASM(a, "\x48\x83\xe8\x01"); /* sub rax, 1 */
+      LASM(a, "\x48\x01\xc8");     /* add rax, rcx */
+      LASM_JO(a, LJIT_EXIT(k, 1));
+      break;
+    case LJIT_SUB:
+      LASM(a, "\x48\x29\xc8");     /* sub rax, rcx */
+      LASM_JO(a, LJIT_EXIT(k, 1));
+      LASM(a, "\x48\x83\xc8\x01"); /* or rax, 1 */
+      break;
+    case LJIT_MUL:
+      LASM(a, "\x48\xd1\xf8");     /* sar rax, 1 */
+      LASM(a, "\x48\x83\xe9\x01"); /* sub rcx, 1 */
+      LASM(a, "\x48\x0f\xaf\xc1"); /* imul rax, rcx */
+      LASM_JO(a, LJIT_EXIT(k, 1));
+      LASM(a, "\x48\x83\xc8\x01"); /* or rax, 1 */
+      break;
+    default:
+      LASM(a, "\x48\x39\xc8");     /* cmp rax, rcx */
+      LASM(a, "\x0f");             /* setcc al */
+      lasm_bytes(a, &setcc, 1);
+      LASM(a, "\xc0");
+      LASM(a, "\x0f\xb6\xc0");     /* movzx eax, al */
+      LASM(a, "\x48\x8d\x44\x00\x01"); /* lea rax, [rax + rax + 1] */
+      break;
+  }
+
+  LASM(a, "\x48\x89\x43\xe8");     /* mov [rbx - 24], rax */
+  LASM(a, "\x48\x83\xeb\x10");     /* sub rbx, 16 */
+}
+
+/*
+ * Walks the chunk keeping track of which instruction pushed each operand,
+ * to find what pushed the function of each call, and of how deep the
+ * operands get. Both branches of an if start at the same depth and leave
+ * one value, so one pass over them in order is enough.
+ */
+int ljit_callees(lchunk* chunk, int* callee) {
+  int n = chunk->count;
+  int* pushed = malloc(sizeof(int) * (n + 1));
+  int* depth_at = malloc(sizeof(int) * (n + 1));
+  char* join = calloc(n + 1, 1);
+  for (int k = 0; k <= n; k++) { depth_at[k] = -1; }
+
+  int depth = 0;
+  int max = 0;
+  for (int k = 0; k < n; k++) {
+    linstr* in = &chunk->code[k];
+    if (depth_at[k] >= 0) { depth = depth_at[k]; }
+    /* the value an if leaves could be from either branch */
+    if (join[k] && depth > 0) { pushed[depth - 1] = -1; }
+    callee[k] = -1;
+
+    switch (in->op) {
+      case OP_CALL:
+      case OP_TAIL_CALL:
+        depth -= in->arg;
+        callee[k] = pushed[depth];
+        pushed[depth++] = k;
+        break;
+      case OP_LAMBDA:
+        depth -= 2;
+        pushed[depth++] = k;
+        break;
+      case OP_JUMP:
+        depth_at[in->arg] = depth;
+        join[in->arg] = 1;
+        break;
+      case OP_JUMP_FALSE:
+        depth_at[in->arg] = --depth;
+        break;
+      case OP_RETURN:
+        depth--;
+        break;
+      default:
+        pushed[depth++] = k;
+        break;
+    }
+    if (depth > max) { max = depth; }
+  }
+
+  free(pushed);
+  free(depth_at);
+  free(join);
+  return max;
+}
+
+/* the name perf shows for chunk: the global it is the body of, if any */
+char* ljit_name(lenv* env, lchunk* chunk) {
+  for (int i = 0; i < env->capacity; i++) {
+    lval* val = env->entries[i].val;
+    if (env->entries[i].sym && lval_is_lambda(val)
+        && val->lambda->chunk == chunk) {
+      return env->entries[i].sym;
+    }
+  }
+  return "(lambda)";
+}
+
+/* compiles chunk to native code, which lvm_run then runs; 0 if it can't */
+int ljit_compile(lenv* env, lchunk* chunk) {
+  int n = chunk->count;
+  int* callee = malloc(sizeof(int) * n);
+  int* offsets = malloc(sizeof(int) * n);
+  char* native = calloc(n, 1);
+  int max_stack = ljit_callees(chunk, callee);
+  lasm a = { 0 };
+
+  /* ljit_fn: save what we use, then jump to start */
+  LASM(&a, "\x53");                 /* push rbx */
+  LASM(&a, "\x41\x54");             /* push r12 */
+  LASM(&a, "\x41\x56");             /* push r14 */
+  LASM(&a, "\x48\x89\xfb");         /* mov rbx, rdi */
+  LASM(&a, "\x49\x89\xf4");         /* mov r12, rsi */
+  LASM(&a, "\x49\x89\xd6");         /* mov r14, rdx */
+  LASM(&a, "\xff\xe1");             /* jmp rcx */
+
+  for (int k = 0; k < n; k++) {
+    linstr* in = &chunk->code[k];
+    offsets[k] = a.count;
+    native[k] = 1;
+
+    switch (in->op) {
+      case OP_CONST: {
+        lval* val = chunk->consts[in->arg];
+        LASM(&a, "\x48\xb8");       /* mov rax, val */
+        lasm_u64(&a, (uintptr_t)val);
+        ljit_push_rax(&a);
+        break;
+      }
+
+      case OP_LOOKUP:
+        LASM(&a, "\x48\xb9");       /* mov rcx, in */
+        lasm_u64(&a, (uintptr_t)in);
+        LASM(&a, "\x4c\x3b\xb1");   /* cmp r14, [rcx + cache.env] */
+        lasm_u32(&a, offsetof(linstr, cache) + offsetof(lcache, env));
+        LASM_JNE(&a, LJIT_EXIT(k, 1));
+        LASM(&a, "\x49\x8b\x86");   /* mov rax, [r14 + version] */
+        lasm_u32(&a, offsetof(lenv, version));
+        LASM(&a, "\x48\x3b\x81");   /* cmp rax, [rcx + cache.version] */
+        lasm_u32(&a, offsetof(linstr, cache) + offsetof(lcache, version));
+        LASM_JNE(&a, LJIT_EXIT(k, 1));
+        LASM(&a, "\x48\x8b\x81");   /* mov rax, [rcx + cache.entry] */
+        lasm_u32(&a, offsetof(linstr, cache) + offsetof(lcache, entry));
+        LASM(&a, "\x48\x8b\x80");   /* mov rax, [rax + val] */
+        lasm_u32(&a, offsetof(lentry, val));
+        ljit_push_rax(&a);
+        break;
+
+      case OP_LOCAL:
+        LASM(&a, "\x49\x8b\x84\x24"); /* mov rax, [r12 + slots[arg]] */
+        lasm_u32(&a, offsetof(lframe, slots) + sizeof(lval*) * in->arg);
+        ljit_push_rax(&a);
+        break;
+
+      case OP_FREE:
+        LASM(&a, "\x49\x8b\x84\x24"); /* mov rax, [r12 + free] */
+        lasm_u32(&a, offsetof(lframe, free));
+        LASM(&a, "\x48\x8b\x80");     /* mov rax, [rax + arg] */
+        lasm_u32(&a, sizeof(lval*) * in->arg);
+        ljit_push_rax(&a);
+        break;
+
+      case OP_JUMP:
+        LASM_JMP(&a, in->arg);
+        break;
+
+      case OP_JUMP_FALSE:
+        LASM(&a, "\x48\x8b\x43\xf8"); /* mov rax, [rbx - 8] */
+        LASM(&a, "\xa8\x01");         /* test al, 1 */
+        LASM_JE(&a, LJIT_EXIT(k, 1));
+        LASM(&a, "\x48\x83\xeb\x08"); /* sub rbx, 8 */
+        LASM(&a, "\x48\x83\xf8\x01"); /* cmp rax, fixnum 0 */
+        LASM_JE(&a, in->arg);
+        break;
+
+      case OP_CALL:
+      case OP_TAIL_CALL: {
+        /* speculate on whatever the function's lookup found last,
+           unless the environment has moved its entries since */
+        int from = callee[k];
+        linstr* lookup = from >= 0 ? &chunk->code[from] : NULL;
+        char setcc = 0;
+        int op = LJIT_GENERIC;
+        if (in->arg == 3 && lookup && lookup->op == OP_LOOKUP
+            && lookup->cache.env
+            && lookup->cache.version == lookup->cache.env->version) {
+          op = ljit_op_of(lookup->cache.entry->val, &setcc);
+        }
+
+        if (op == LJIT_GENERIC) {
+          native[k] = 0;
+          LASM_JMP(&a, LJIT_EXIT(k, 0));
+          break;
+        }
+        ljit_binary(&a, k, lookup->cache.entry->val, op, setcc);
+        /* a tail call's value is what the chunk returns */
+        if (in->op == OP_TAIL_CALL) { LASM_JMP(&a, LJIT_EXIT(n - 1, 0)); }
+        break;
+      }
+
+      default:
+        native[k] = 0;
+        LASM_JMP(&a, LJIT_EXIT(k, 0));
+        break;
+    }
+  }
+
+  /* the exit stubs, and then the way out they share */
+  int stubs = a.count;
+  for (int i = 0; i < a.fixup_count; i++) {
+    if (a.fixups[i].target >= 0) { continue; }
+    int exit = ~a.fixups[i].target;
+    a.fixups[i].target = n + (a.count - stubs);
+    LASM(&a, "\xba");               /* mov edx, exit */
+    lasm_u32(&a, exit);
+    LASM(&a, "\xe9");               /* jmp leave */
+    lasm_u32(&a, 0);
+  }
+  int leave = a.count;
+  LASM(&a, "\x48\x89\xd8");         /* mov rax, rbx */
+  LASM(&a, "\x41\x5e");             /* pop r14 */
+  LASM(&a, "\x41\x5c");             /* pop r12 */
+  LASM(&a, "\x5b");                 /* pop rbx */
+  LASM(&a, "\xc3");                 /* ret */
+
+  for (int at = stubs; at < leave; at += 10) {
+    int32_t rel = leave - (at + 10);
+    memcpy(a.bytes + at + 6, &rel, 4);
+  }
+  for (int i = 0; i < a.fixup_count; i++) {
+    int target = a.fixups[i].target;
+    int to = target < n ? offsets[target] : stubs + (target - n);
+    int32_t rel = to - (a.fixups[i].at + 4);
+    memcpy(a.bytes + a.fixups[i].at, &rel, 4);
+  }
+
+  long page = sysconf(_SC_PAGESIZE);
+  size_t size = (a.count + page - 1) / page * page;
+  unsigned char* code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  int ok = code != MAP_FAILED;
+  if (ok) {
+    memcpy(code, a.bytes, a.count);
+    ok = mprotect(code, size, PROT_READ | PROT_EXEC) == 0;
+    if (!ok) { munmap(code, size); }
+  }
+
+  ljit* result = malloc(sizeof(ljit));
+  result->enter = ok ? (ljit_fn)code : NULL;
+  result->code = ok ? code : NULL;
+  result->size = size;
+  result->entries = malloc(sizeof(void*) * n);
+  result->max_stack = max_stack;
+  result->deopts = 0;
+  for (int k = 0; k < n; k++) {
+    result->entries[k] = ok && native[k] ? code + offsets[k] : NULL;
+  }
+  chunk->jit = result;
+
+  if (ok && jit.perf_map) {
+    if (!jit.map) {
+      char path[64];
+      snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+      jit.map = fopen(path, "a");
+    }
+    if (jit.map) {
+      fprintf(jit.map, "%lx %x lispy:%s\n", (unsigned long)code, a.count,
+              ljit_name(env, chunk));
+      fflush(jit.map);
+    }
+  }
+
+  free(a.bytes);
+  free(a.fixups);
+  free(callee);
+  free(offsets);
+  free(native);
+  return ok;
+}
+
+#endif
+
+
+// VM
+
+/* GCC and clang support labels as values, which we use for threading */
+#if defined(__GNUC__)
+#define LVM_THREADED 1
+#else
+#define LVM_THREADED 0
+#endif
+
+/* where to go back to when a lambda's body returns */
+typedef struct {
+  lchunk* chunk;
+  linstr* ip;
+  lframe* frame;
+  lval* memo; /* the memo function to file the result with, or NULL */
+  lval* key;  /* and the arguments to file it under */
+} lcall;
+
+/*
+ * The operand stack and the call records are shared by nested runs, e.g.
+ * through builtin_eval. Calls between lambdas never nest lvm_run, so only
+ * these grow with the depth of the recursion, never the C stack.
+ */
+struct {
+  int count;
+  int capacity;
+  lval** stack;
+
+  int call_count;
+  int call_capacity;
+  lcall* calls;
+} vm;
+
+void lvm_push(lval* val) {
+  if (vm.count == vm.capacity) {
+    vm.capacity = vm.capacity ? vm.capacity * 2 : 64;
+    vm.stack = realloc(vm.stack, sizeof(lval*) * vm.capacity);
+  }
+  vm.stack[vm.count++] = val;
+}
+
+/* room for n more values without reallocating */
+void lvm_reserve(int n) {
+  while (vm.capacity - vm.count < n) {
+    vm.capacity = vm.capacity ? vm.capacity * 2 : 64;
+    vm.stack = realloc(vm.stack, sizeof(lval*) * vm.capacity);
+  }
+}
+
+/* cleared by 'lispy --bench lookup' to compare against plain lenv_get */
+int lvm_caching = 1;
+
+/* the slow path of OP_LOOKUP, which fills in the cache when it can */
+lval* lvm_lookup(lenv* env, lchunk* chunk, linstr* in) {
+  lval* key = chunk->consts[in->arg];
+  lentry* entry = lenv_entry(env, key);
+  if (!entry) { return lval_err("Unbound symbol: '%s'", lval_sym_of(key)); }
+
+  if (lvm_caching) {
+    in->cache.env = env;
+    in->cache.version = env->version;
+    in->cache.entry = entry;
+  }
+  return lval_ref(entry->val);
+}
+
+/* pops the top n values and applies them like lval_eval would */
+lval* lvm_call(lenv* env, int n) {
+  /* a safe point: everything live is on the stack or held by a caller */
+  lgc_poll();
+
+  lval** frame = &vm.stack[vm.count - n];
+  vm.count -= n;
+
+  for (int i = 0; i < n; i++) {
+    if (lval_type_of(frame[i]) == LVAL_ERR) {
+      lval* err = frame[i];
+      for (int j = 0; j < n; j++) {
+        if (j != i) { lval_del(frame[j]); }
+      }
+      return err;
+    }
+  }
+
+  lval* args = lval_sexpr();
+  lval_reserve(args, n - 1);
+  for (int i = 1; i < n; i++) {
+    lval_add(args, frame[i]);
+  }
+
+  return lval_call(env, frame[0], args);
+}
+
+/*
+ * Pops a lambda and its n - 1 arguments into a frame for the call, or
+ * returns NULL with *err set to the first error among them or to the
+ * lambda's complaint about the argument count.
+ */
+lframe* lvm_bind(int n, lval** err) {
+  /* a safe point, like lvm_call */
+  lgc_poll();
+
+  lval** frame = &vm.stack[vm.count - n];
+  vm.count -= n;
+
+  for (int i = 1; i < n; i++) {
+    if (lval_type_of(frame[i]) == LVAL_ERR) {
+      *err = frame[i];
+      for (int j = 0; j < n; j++) {
+        if (j != i) { lval_del(frame[j]); }
+      }
+      return NULL;
+    }
+  }
+
+  return lframe_bind(frame[0], frame + 1, n - 1, err);
+}
+
+void lvm_save(lchunk* chunk, linstr* ip, lframe* frame) {
+  if (vm.call_count == vm.call_capacity) {
+    vm.call_capacity = vm.call_capacity ? vm.call_capacity * 2 : 64;
+    vm.calls = realloc(vm.calls, sizeof(lcall) * vm.call_capacity);
+  }
+  lcall* call = &vm.calls[vm.call_count++];
+  call->chunk = chunk;
+  call->ip = ip;
+  call->frame = frame;
+  call->memo = NULL;
+}
+
+/*
+ * Pops a memo function and its n - 1 arguments. Returns the value of the
+ * call when there is one already, remembered or from lmemo_apply, or
+ * NULL with *callee bound for the lambda behind it and *key holding the
+ * arguments to file its result under.
+ */
+lval* lvm_memo(lenv* env, int n, lframe** callee, lval** key) {
+  /* a safe point, like lvm_call */
+  lgc_poll();
+
+  lval** frame = &vm.stack[vm.count - n];
+  vm.count -= n;
+
+  for (int i = 1; i < n; i++) {
+    if (lval_type_of(frame[i]) == LVAL_ERR) {
+      lval* err = frame[i];
+      for (int j = 0; j < n; j++) {
+        if (j != i) { lval_del(frame[j]); }
+      }
+      return err;
+    }
+  }
+
+  lval* memo = frame[0];
+  lval* args = lval_sexpr();
+  lval_reserve(args, n - 1);
+  for (int i = 1; i < n; i++) {
+    lval_add(args, frame[i]);
+  }
+
+  lval* result = lmemo_recall(memo, args);
+  lval* fn = lmemo_fn(memo);
+  if (result) {
+    lval_del(memo);
+    lval_del(args);
+    return result;
+  }
+  if (!lval_is_lambda(fn) || fn->lambda->memo) {
+    return lmemo_apply(env, memo, args);
+  }
+
+  *callee = lframe_bind_list(lval_ref(fn), lval_ref(args), &result);
+  if (!*callee) {
+    lval_del(memo);
+    lval_del(args);
+    return result;
+  }
+  *key = args;
+  return NULL;
+}
+
+/*
+ * Runs chunk with frame holding the locals of its innermost scope, and
+ * takes over the caller's reference to frame.
+ */
+lval* lvm_run(lenv* env, lchunk* chunk, lframe* frame) {
+  linstr* ip;
+  linstr* in;
+
+  if (ldepth.nested >= LDEPTH_C_MAX) {
+    lframe_release(frame);
+    return ldepth_err(
+      lval_err("Evaluation nested more than %i deep", LDEPTH_C_MAX));
+  }
+  ldepth.nested++;
+
+  /* call records and values below these belong to whoever called us */
+  int base = vm.call_count;
+  int sp = vm.count;
+  lval* unwound;
+
+#if LVM_THREADED
+  static void* labels[] = {
+    [OP_CONST] = &&do_OP_CONST,
+    [OP_LOOKUP] = &&do_OP_LOOKUP,
+    [OP_LOCAL] = &&do_OP_LOCAL,
+    [OP_FREE] = &&do_OP_FREE,
+    [OP_CALL] = &&do_OP_CALL,
+    [OP_TAIL_CALL] = &&do_OP_TAIL_CALL,
+    [OP_LAMBDA] = &&do_OP_LAMBDA,
+    [OP_JUMP] = &&do_OP_JUMP,
+    [OP_JUMP_FALSE] = &&do_OP_JUMP_FALSE,
+    [OP_RETURN] = &&do_OP_RETURN,
+  };
+
+#define LVM_ENTER(next)                                           \
+  chunk = (next);                                                 \
+  ip = chunk->code;                                               \
+  if (!chunk->threaded) {                                         \
+    for (int i = 0; i < chunk->count; i++) {                      \
+      chunk->code[i].target = labels[chunk->code[i].op];          \
+    }                                                             \
+    chunk->threaded = 1;                                          \
+  }                                                               \
+  LVM_TIER_UP()
+
+#if LJIT
+  /* instructions with native code dispatch to it instead */
+#define LVM_TIER_UP()                                             \
+  if (++chunk->calls == jit.threshold && !chunk->jit              \
+      && ljit_compile(env, chunk)) {                              \
+    for (int i = 0; i < chunk->count; i++) {                      \
+      if (chunk->jit->entries[i]) {                               \
+        chunk->code[i].target = &&do_native;                      \
+      }                                                           \
+    }                                                             \
+  }
+#else
+#define LVM_TIER_UP()
+#endif
+#define LVM_CASE(op) do_##op:
+#define LVM_DISPATCH() in = ip++; goto *in->target
+
+  LVM_ENTER(chunk);
+  LVM_DISPATCH();
+#else
+#define LVM_ENTER(next) chunk = (next); ip = chunk->code
+#define LVM_CASE(op) case op:
+#define LVM_DISPATCH() continue
+
+  LVM_ENTER(chunk);
+  for (;;) {
+    in = ip++;
+    switch (in->op) {
+#endif
+
+#if LJIT
+  /* in has native code; run from there until it exits */
+  do_native: {
+    ljit* native = chunk->jit;
+    lvm_reserve(native->max_stack);
+    ljit_exit out = native->enter(vm.stack + vm.count, frame, env,
+                                  native->entries[in - chunk->code]);
+    vm.count = out.sp - vm.stack;
+    in = chunk->code + (out.exit >> 1);
+    ip = in + 1;
+
+    /* the interpreter is better off with a chunk whose guards keep
+       failing, and it always runs the instruction that exited */
+    if ((out.exit & 1) && ++native->deopts == LJIT_MAX_DEOPTS) {
+      ljit_discard(native);
+      for (int i = 0; i < chunk->count; i++) {
+        chunk->code[i].target = labels[chunk->code[i].op];
+      }
+    }
+    goto *labels[in->op];
+  }
+#endif
+
+  LVM_CASE(OP_CONST)
+    lvm_push(lval_ref(chunk->consts[in->arg]));
+    LVM_DISPATCH();
+
+  LVM_CASE(OP_LOOKUP)
+    if (in->cache.env == env && in->cache.version == env->version) {
+      lvm_push(lval_ref(in->cache.entry->val));
+    } else {
+      lvm_push(lvm_lookup(env, chunk, in));
+    }
+    LVM_DISPATCH();
+
+  LVM_CASE(OP_LOCAL)
+    lvm_push(lval_ref(frame->slots[in->arg]));
+    LVM_DISPATCH();
+
+  LVM_CASE(OP_FREE)
+    lvm_push(lval_ref(frame->free[in->arg]));
+    LVM_DISPATCH();
+
+  LVM_CASE(OP_CALL)
+  LVM_CASE(OP_TAIL_CALL) {
+    lval* fn = vm.stack[vm.count - in->arg];
+    if (!lval_is_lambda(fn) || fn->lambda->memo) {
+      /*
+       * A memo function that has to run its lambda gets a call record
+       * even in tail position, to file the result when it returns; the
+       * code after a tail call only ever jumps on to OP_RETURN.
+       */
+      lframe* callee = NULL;
+      lval* key = NULL;
+      lcaller = frame;
+      lval* result = lval_is_lambda(fn)
+        ? lvm_memo(env, in->arg, &callee, &key) : lvm_call(env, in->arg);
+      if (callee && vm.call_count >= ldepth.max) {
+        lframe_release(callee);
+        lval_del(fn);
+        lval_del(key);
+        unwound = ldepth_err(
+          lval_err("Maximum depth of %li exceeded", ldepth.max));
+        goto unwind;
+      }
+      if (ldepth.exceeded) {
+        unwound = result;
+        goto unwind;
+      }
+      if (!callee) {
+        lvm_push(result);
+        if (in->op == OP_TAIL_CALL) { goto leave; }
+        LVM_DISPATCH();
+      }
+
+      lvm_save(chunk, ip, frame);
+      vm.calls[vm.call_count - 1].memo = fn;
+      vm.calls[vm.call_count - 1].key = key;
+      frame = callee;
+      LVM_ENTER(llambda_code(callee->fn->lambda));
+      LVM_DISPATCH();
+    }
+
+    lval* err;
+    lframe* callee = lvm_bind(in->arg, &err);
+    if (!callee) {
+      lvm_push(err);
+      if (in->op == OP_TAIL_CALL) { goto leave; }
+      LVM_DISPATCH();
+    }
+
+    if (in->op == OP_CALL && vm.call_count >= ldepth.max) {
+      lframe_release(callee);
+      unwound = ldepth_err(
+        lval_err("Maximum depth of %li exceeded", ldepth.max));
+      goto unwind;
+    }
+
+    /* a tail call has nothing left to do here, so it keeps our record */
+    if (in->op == OP_CALL) {
+      lvm_save(chunk, ip, frame);
+    } else {
+      lframe_release(frame);
+    }
+    frame = callee;
+    LVM_ENTER(llambda_code(callee->fn->lambda));
+    LVM_DISPATCH();
+  }
+
+  LVM_CASE(OP_LAMBDA) {
+    lval* body = vm.stack[--vm.count];
+    lval* formals = vm.stack[--vm.count];
+    lvm_push(lval_close(formals, body, frame));
+    LVM_DISPATCH();
+  }
+
+  LVM_CASE(OP_JUMP)
+    ip = chunk->code + in->arg;
+    LVM_DISPATCH();
+
+  LVM_CASE(OP_JUMP_FALSE) {
+    lval* cond = vm.stack[--vm.count];
+    if (lval_is_number(cond)) {
+      if (!lval_is_true(cond)) { ip = chunk->code + in->arg; }
+      lval_del(cond);
+      LVM_DISPATCH();
+    }
+
+    /* the error is the value of the if, and the OP_JUMP that ends the
+       first branch skips the second */
+    lval* err = lval_type_of(cond) == LVAL_ERR
+      ? lval_ref(cond) : lval_err("Function 'if' passed incorrect type");
+    lval_del(cond);
+    lvm_push(err);
+    ip = chunk->code + in->arg - 1;
+    LVM_DISPATCH();
+  }
+
+  /* the result stays where the call's operands were */
+  LVM_CASE(OP_RETURN)
+  leave:
+    lframe_release(frame);
+    if (vm.call_count == base) {
+      ldepth_leave();
+      return vm.stack[--vm.count];
+    }
+
+    vm.call_count--;
+    if (vm.calls[vm.call_count].memo) {
+      lmemo_store(vm.calls[vm.call_count].memo, vm.calls[vm.call_count].key,
+                  vm.stack[vm.count - 1]);
+    }
+    chunk = vm.calls[vm.call_count].chunk;
+    ip = vm.calls[vm.call_count].ip;
+    frame = vm.calls[vm.call_count].frame;
+    LVM_DISPATCH();
+
+  /* past a depth limit, the calls this run made are dropped */
+  unwind:
+    lframe_release(frame);
+    while (vm.call_count > base) {
+      lcall* call = &vm.calls[--vm.call_count];
+      lframe_release(call->frame);
+      if (call->memo) {
+        lval_del(call->memo);
+        lval_del(call->key);
+      }
+    }
+    while (vm.count > sp) { lval_del(vm.stack[--vm.count]); }
+    ldepth_leave();
+    return unwound;
+
+#if !LVM_THREADED
+    }
+  }
+#endif
+
+#undef LVM_ENTER
+#undef LVM_CASE
+#undef LVM_DISPATCH
+}
+
+/* evaluate val, consuming it, with whichever evaluator is selected */
+lval* lval_run(lenv* env, lval* val) {
+  if (vm_disabled) {
+    return lval_eval(env, NULL, val);
+  }
+
+  lchunk* chunk = lchunk_compile(val, NULL);
+  lval_del(val);
+
+  lval* result = lvm_run(env, chunk, NULL);
+  lchunk_del(chunk);
+  return result;
+}
+
+/*
+ * Code kept as data, like a Q-expression that is passed to eval in a
+ * loop, tends to be run over and over, so the chunks compiled for eval
+ * and if are cached by the Q-expression's address. An entry holds a
+ * reference to it, so the address can't be reused while it is cached,
+ * and since shared values are immutable it can't change either. A chunk
+ * is only run again in the environment and at the version it was
+ * compiled for, and with the locals of the same lambda, whose scope it
+ * was compiled in; the entry holds that lambda too. Lists have no room
+ * to spare for a pointer to their code, which is why this is a table
+ * rather than a field.
+ */
+
+#define LQUOTED_CACHE_SIZE 256
+
+typedef struct {
+  lval* code;
+  lenv* env;
+  unsigned long version;
+  llambda* lambda; /* NULL for code run at the top level */
+  lchunk* chunk;
+  int running; /* runs in progress, during which it can't be replaced */
+} lquoted;
+
+struct {
+  int enabled; /* cleared with --no-eval-cache */
+  unsigned long hits;
+  unsigned long misses;
+  lquoted entries[LQUOTED_CACHE_SIZE];
+} lquoted_cache = { .enabled = 1 };
+
+/*
+ * Evaluate the Q-expression code as an S-expression with the locals of
+ * frame, which may be NULL at the top level; consumes code but not frame.
+ */
+lval* lval_run_quoted(lenv* env, lframe* frame, lval* code) {
+  if (vm_disabled) {
+    lval* expr = lval_unshare(code);
+    expr->type = LVAL_SEXPR;
+    return lval_eval(env, frame, expr);
+  }
+
+  llambda* lambda = frame ? frame->fn->lambda : NULL;
+  lscope* scope = lambda ? &lambda->scope : NULL;
+  unsigned long hash = lenv_hash((char*)code);
+  lquoted* entry = &lquoted_cache.entries[hash % LQUOTED_CACHE_SIZE];
+
+  int hit = entry->code == code && entry->lambda == lambda
+    && entry->env == env && entry->version == env->version;
+  if (frame) { frame->refs++; }
+  if (!lquoted_cache.enabled || (!hit && entry->running > 0)) {
+    lval* expr = lval_unshare(code);
+    expr->type = LVAL_SEXPR;
+    lchunk* chunk = lchunk_compile(expr, scope);
+    lval_del(expr);
+
+    lval* result = lvm_run(env, chunk, frame);
+    lchunk_del(chunk);
+    return result;
+  }
+
+  if (hit) {
+    lquoted_cache.hits++;
+  } else {
+    lquoted_cache.misses++;
+    if (entry->code) {
+      lval_del(entry->code);
+      if (entry->lambda) { llambda_release(entry->lambda); }
+      lchunk_del(entry->chunk);
+    }
+    entry->code = lval_ref(code);
+    entry->env = env;
+    entry->version = env->version;
+    entry->lambda = lambda;
+    if (lambda) { lambda->refs++; }
+    entry->chunk = lchunk_new();
+    lchunk_compile_quoted(entry->chunk, code, scope, 0);
+    lchunk_emit(entry->chunk, OP_RETURN, 0);
+  }
+
+  entry->running++;
+  lval* result = lvm_run(env, entry->chunk, frame);
+  entry->running--;
+  lval_del(code);
+  return result;
+}
+
+
+// Garbage Collection
+
+/*
+ * A mark-and-sweep pass over every live cell in the nursery and the pool.
+ * The roots are the lenv tables and the VM operand stack, plus any value
+ * held from outside the heap (a builtin's arguments, a half-built list,
+ * the locals in an lframe, a lambda's body or captured values). Those
+ * are found the way CPython does it: take away every reference that
+ * comes from another heap value, and whatever still has references left
+ * is held from outside. Only the marked values get their internal
+ * references back, which is exactly the release the sweep needs.
+ *
+ * List buffers are shared between views, so each one is visited once per
+ * pass, with gc_state recording how far through the collection it is.
+ */
+
+enum { LGC_IDLE, LGC_SUBTRACTED, LGC_REACHED, LGC_RESTORED };
+
+/* not counting list buffers, which are shared */
+size_t lval_bytes(lval* val) {
+  size_t bytes = sizeof(lval);
+  if (val->type == LVAL_ERR) { bytes += strlen(val->err) + 1; }
+  if (val->type == LVAL_BIG) { bytes += sizeof(uint32_t) * val->size; }
+  return bytes;
+}
+
+int lval_has_cells(lval* val) {
+  return !lval_is_immediate(val)
+    && (val->type == LVAL_SEXPR || val->type == LVAL_QEXPR)
+    && val->cell;
+}
+
+/* adds delta to the refcount of each heap value the buffer holds */
+void lgc_adjust_cells(lcells* cells, int delta) {
+  for (int i = cells->lo; i < cells->hi; i++) {
+    lval* item = cells->items[i];
+    if (!lval_is_immediate(item)) { item->refs += delta; }
+  }
+}
+
+struct {
+  int count;
+  int capacity;
+  lval** items;
+} lgc_stack;
+
+void lgc_mark(lval* val) {
+  if (lval_is_immediate(val) || val->marked) { return; }
+  val->marked = 1;
+
+  if (lgc_stack.count == lgc_stack.capacity) {
+    lgc_stack.capacity = lgc_stack.capacity ? lgc_stack.capacity * 2 : 256;
+    lgc_stack.items = realloc(lgc_stack.items,
+                              sizeof(lval*) * lgc_stack.capacity);
+  }
+  lgc_stack.items[lgc_stack.count++] = val;
+}
+
+/* everything the buffer holds stays alive, not just what the view sees */
+void lgc_trace(void) {
+  while (lgc_stack.count > 0) {
+    lval* val = lgc_stack.items[--lgc_stack.count];
+    if (!lval_has_cells(val)) { continue; }
+
+    lcells* cells = lval_cells(val);
+    if (cells->gc_state == LGC_REACHED) { continue; }
+    cells->gc_state = LGC_REACHED;
+
+    for (int i = cells->lo; i < cells->hi; i++) {
+      lgc_mark(cells->items[i]);
+    }
+  }
+}
+
+/* every live heap value, in no particular order; the caller frees it */
+lval** lheap_values(void) {
+  lval** all = malloc(sizeof(lval*) * (heap.count + 1));
+  long n = 0;
+
+  /* the current block is never on the used list */
+  lblock* block = nursery.current;
+  lblock* next = nursery.used;
+  while (block) {
+    lval* end = (lval*)lblock_end(block);
+    for (lval* val = (lval*)lblock_start(block); val < end; val++) {
+      if (!val->dead) { all[n++] = val; }
+    }
+
+    block = next;
+    next = block ? block->next : NULL;
+  }
+
+  for (lpage* page = pool.pages; page; page = page->next) {
+    lval* end = lpage_end(&pool, page);
+    for (lval* val = lpage_start(page); val < end; val++) {
+      if (!val->dead) { all[n++] = val; }
+    }
+  }
+
+  all[n] = NULL;
+  return all;
+}
+
+void lgc_collect(void) {
+  clock_t start = clock();
+  lval** all = lheap_values();
+
+  /* leave only the references that come from outside the heap */
+  for (lval** val = all; *val; val++) {
+    if (!lval_has_cells(*val)) { continue; }
+    lcells* cells = lval_cells(*val);
+    if (cells->gc_state != LGC_IDLE) { continue; }
+    cells->gc_state = LGC_SUBTRACTED;
+    lgc_adjust_cells(cells, -1);
+  }
+
+  /* mark */
+  for (int i = 0; i < heap.env_count; i++) {
+    lenv* env = heap.envs[i];
+    for (int j = 0; j < env->capacity; j++) {
+      if (env->entries[j].sym) { lgc_mark(env->entries[j].val); }
+    }
+  }
+  for (int i = 0; i < vm.count; i++) {
+    lgc_mark(vm.stack[i]);
+  }
+  for (lval** val = all; *val; val++) {
+    if ((*val)->refs > 0) { lgc_mark(*val); }
+  }
+  lgc_trace();
+
+  for (lval** val = all; *val; val++) {
+    if (!(*val)->marked || !lval_has_cells(*val)) { continue; }
+    lcells* cells = lval_cells(*val);
+    if (cells->gc_state != LGC_REACHED) { continue; }
+    cells->gc_state = LGC_RESTORED;
+    lgc_adjust_cells(cells, 1);
+  }
+
+  size_t freed = 0;
+  long freed_count = 0;
+  size_t live = 0;
+
+  for (lval** val = all; *val; val++) {
+    if (!(*val)->marked) { continue; }
+    live += lval_bytes(*val);
+
+    if ((*val)->type == LVAL_VEC) {
+      lvec* vec = lval_vec_of(*val);
+      if (vec->gc_epoch == heap.collections + 1) { continue; }
+      vec->gc_epoch = heap.collections + 1;
+      live += lvec_bytes(vec);
+    }
+
+    if (!lval_has_cells(*val)) { continue; }
+    lcells* cells = lval_cells(*val);
+    if (cells->gc_state == LGC_IDLE) { continue; }
+    cells->gc_state = LGC_IDLE;
+    live += lcells_bytes(cells);
+  }
+
+  /*
+   * sweep; a buffer that only garbage can see never got its references
+   * back, so it is freed without releasing anything
+   */
+  for (lval** val = all; *val; val++) {
+    if ((*val)->marked) {
+      (*val)->marked = 0;
+      continue;
+    }
+
+    if (lval_has_cells(*val)) {
+      lcells* cells = lval_cells(*val);
+      if (--cells->refs == 0) {
+        freed += lcells_bytes(cells);
+        free(cells);
+      }
+    }
+
+    /* vectors hold no values, so they can go the usual way */
+    if ((*val)->type == LVAL_VEC) {
+      lvec* vec = lval_vec_of(*val);
+      if (vec->refs == 1) { freed += lvec_bytes(vec); }
+      lvec_release(vec);
+    }
+
+    freed += lval_bytes(*val);
+    freed_count++;
+    lval_free(*val);
+  }
+
+  free(all);
+  heap.allocated = 0;
+  heap.collections++;
+
+  double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+  heap.total_pause += pause;
+
+  if (heap.verbose) {
+    fprintf(stderr,
+            "gc #%li: %.3f ms pause, freed %li values (%zu bytes), "
+            "heap now %li values (%zu bytes); "
+            "pool has %li live cells in %li pages, %.1f%% reused\n",
+            heap.collections, pause * 1e3, freed_count, freed,
+            heap.count, live,
+            pool.live, pool.page_count, lpool_reuse_rate(&pool) * 100);
+  }
+}
+
+/* a safe point: collect if enough has been allocated since the last time */
+void lgc_poll(void) {
+  if (heap.allocated >= heap.threshold) { lgc_collect(); }
+}
+
+
+// Benchmarks
+
+/* run with 'lispy --bench <name>'; timings are CPU time from clock() */
+
+void lenv_add_all_builtins(lenv* env);
+
+double bench_seconds(clock_t start) {
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/* lookup cost should stay flat as the number of bindings grows */
+void bench_env(void) {
+  int lookups = 1000000;
+
+  printf("%10s %14s\n", "bindings", "ns/lookup");
+  for (int n = 16; n <= 65536; n *= 4) {
+    lenv* env = lenv_new();
+    lval** keys = malloc(sizeof(lval*) * n);
+
+    char name[32];
+    for (int i = 0; i < n; i++) {
+      snprintf(name, sizeof(name), "sym%i", i);
+      keys[i] = lval_sym(name);
+      lval* val = lval_num(i);
+      lenv_put(env, keys[i], val);
+      lval_del(val);
+    }
+
+    clock_t start = clock();
+    for (int i = 0; i < lookups; i++) {
+      lval_del(lenv_get(env, keys[(i * 7919L) % n]));
+    }
+    double secs = bench_seconds(start);
+
+    printf("%10i %14.1f\n", n, secs * 1e9 / lookups);
+
+    for (int i = 0; i < n; i++) { lval_del(keys[i]); }
+    free(keys);
+    lenv_del(env);
+  }
+}
+
+/* short-lived garbage shaped like a nested argument list */
+void bench_alloc_churn(long rounds) {
+  for (long i = 0; i < rounds; i++) {
+    lval* args = lval_sexpr();
+    for (int j = 0; j < 8; j++) {
+      args = lval_add(args, lval_qexpr());
+    }
+    lval_del(args);
+  }
+}
+
+/* allocation rate through the nursery compared with the slab pool */
+void bench_alloc(void) {
+  long rounds = 1000000;
+  int enabled = nursery.enabled;
+
+  printf("%10s %16s\n", "path", "M values/s");
+  for (int young = 1; young >= 0; young--) {
+    nursery.enabled = young;
+
+    clock_t start = clock();
+    bench_alloc_churn(rounds);
+    double secs = bench_seconds(start);
+
+    printf("%10s %16.1f\n", young ? "nursery" : "pool",
+           rounds * 9 / secs / 1e6);
+  }
+
+  nursery.enabled = enabled;
+}
+
+/* the original side-by-side layout, kept to compare footprints against */
+struct lval_wide {
+  lval_type type;
+  long num;
+  char* err;
+  char* sym;
+  lbuiltin fun;
+  int count;
+  struct lval** cell;
+};
+
+/* heap bytes held by a list and its direct elements */
+size_t bench_list_bytes(lval* list) {
+  size_t bytes = lval_bytes(list) + lcells_bytes(lval_cells(list));
+  for (int i = 0; i < list->count; i++) {
+    if (!lval_is_immediate(list->cell[i])) {
+      bytes += lval_bytes(list->cell[i]);
+    }
+  }
+  return bytes;
+}
+
+/* bytes per element of big Q-expressions, before and after the union */
+void bench_layout(void) {
+  int n = 1000000;
+  char name[32];
+
+  printf("sizeof(lval): %zu bytes, was %zu\n\n",
+         sizeof(lval), sizeof(struct lval_wide));
+  printf("%10s %14s %14s\n", "elements", "before B/elt", "after B/elt");
+
+  lval* nums = lval_qexpr();
+  for (int i = 0; i < n; i++) {
+    nums = lval_add(nums, lval_num(i));
+  }
+  printf("%10s %14.1f %14.1f\n", "numbers",
+         (double)(sizeof(struct lval_wide) + sizeof(lval*)),
+         (double)bench_list_bytes(nums) / n);
+  lval_del(nums);
+
+  /* symbol names used to be copied into every symbol */
+  lval* syms = lval_qexpr();
+  size_t names = 0;
+  for (int i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "sym%i", i % 1000);
+    names += strlen(name) + 1;
+    syms = lval_add(syms, lval_sym(name));
+  }
+  printf("%10s %14.1f %14.1f\n", "symbols",
+         (double)(sizeof(struct lval_wide) + sizeof(lval*)) + (double)names / n,
+         (double)bench_list_bytes(syms) / n);
+  lval_del(syms);
+
+  lval* lists = lval_qexpr();
+  for (int i = 0; i < n; i++) {
+    lists = lval_add(lists, lval_add(lval_qexpr(), lval_num(i)));
+  }
+  size_t after = lval_bytes(lists);
+  for (int i = 0; i < n; i++) {
+    after += bench_list_bytes(lists->cell[i]);
+  }
+  printf("%10s %14.1f %14.1f\n", "{n} lists",
+         (double)(2 * sizeof(struct lval_wide) + 2 * sizeof(lval*)),
+         (double)after / n);
+  lval_del(lists);
+}
+
+lval* bench_range(int n) {
+  lval* list = lval_qexpr();
+  for (int i = 0; i < n; i++) {
+    list = lval_add(list, lval_num(i));
+  }
+  return list;
+}
+
+/* building, summing and joining lists of a million elements */
+void bench_lists(void) {
+  int n = 1000000;
+
+  clock_t start = clock();
+  lval* list = bench_range(n);
+  printf("%-24s %10.3f s\n", "build (lval_add)", bench_seconds(start));
+
+  start = clock();
+  list->type = LVAL_SEXPR;
+  lval* sum = builtin_add(NULL, list);
+  printf("%-24s %10.3f s\n", "sum (builtin_add)", bench_seconds(start));
+  lval_del(sum);
+
+  lval* args = lval_sexpr();
+  args = lval_add(args, bench_range(n));
+  args = lval_add(args, bench_range(n));
+
+  start = clock();
+  lval* joined = builtin_join(NULL, args);
+  printf("%-24s %10.3f s\n", "join (builtin_join)", bench_seconds(start));
+
+  /* the lists stay shared, like the arguments of a recursive function */
+  start = clock();
+  lval* rest = lval_ref(joined);
+  while (rest->count > 1) {
+    lval* shared = lval_ref(rest);
+    args = lval_add(lval_sexpr(), rest);
+    rest = builtin_tail(NULL, args);
+    lval_del(shared);
+  }
+  printf("%-24s %10.3f s\n", "tail a shared list", bench_seconds(start));
+  lval_del(rest);
+  lval_del(joined);
+
+  start = clock();
+  lval* consed = lval_qexpr();
+  for (int i = 0; i < n; i++) {
+    lval* shared = lval_ref(consed);
+    args = lval_add(lval_add(lval_sexpr(), lval_num(i)), consed);
+    consed = builtin_cons(NULL, args);
+    lval_del(shared);
+  }
+  printf("%-24s %10.3f s\n", "cons onto a shared list", bench_seconds(start));
+  lval_del(consed);
+}
+
+/* each kernel set, then the builtins that use the best one */
+void bench_arith(void) {
+  int n = 1000000;
+  int rounds = 100;
+
+  long* xs = malloc(sizeof(long) * n);
+  long* ys = malloc(sizeof(long) * n);
+  long* out = malloc(sizeof(long) * n);
+  for (int i = 0; i < n; i++) {
+    xs[i] = i * 7919L % 20011 - 10000;
+    ys[i] = i % 101 - 50;
+  }
+
+  for (int k = 0; k < LKERNEL_SET_COUNT; k++) {
+    lkernels* kernels = &lkernel_sets[k];
+    if (!lkernels_supported(kernels)) { continue; }
+
+    char label[32];
+    long total = 0;
+
+    clock_t start = clock();
+    for (int r = 0; r < rounds; r++) {
+      long sum = 0;
+      lsum_with(kernels, xs, n, &sum);
+      total += sum;
+    }
+    snprintf(label, sizeof(label), "sum (%s)", kernels->name);
+    printf("%-24s %10.3f s  (%ld)\n", label, bench_seconds(start), total);
+
+    start = clock();
+    for (int r = 0; r < rounds; r++) {
+      kernels->add(xs, ys, 0, out, n);
+    }
+    snprintf(label, sizeof(label), "add (%s)", kernels->name);
+    printf("%-24s %10.3f s  (%ld)\n", label, bench_seconds(start), out[n - 1]);
+
+    total = 0;
+    start = clock();
+    for (int r = 0; r < rounds; r++) {
+      long dot = 0;
+      ldot_with(kernels, xs, ys, n, &dot);
+      total += dot;
+    }
+    snprintf(label, sizeof(label), "dot (%s)", kernels->name);
+    printf("%-24s %10.3f s  (%ld)\n", label, bench_seconds(start), total);
+  }
+  free(xs);
+  free(ys);
+  free(out);
+
+  lbuiltin ops[] = { builtin_add, builtin_sub, builtin_mul };
+  char* names[] = { "+ (builtin_add)", "- (builtin_sub)", "* (builtin_mul)" };
+
+  for (int k = 0; k < 3; k++) {
+    lval* args = bench_range(n);
+    args->type = LVAL_SEXPR;
+
+    clock_t start = clock();
+    for (int r = 0; r < rounds / 10; r++) {
+      lval_del(ops[k](NULL, lval_ref(args)));
+    }
+    printf("%-24s %10.3f s\n", names[k], bench_seconds(start));
+    lval_del(args);
+  }
 
-  return lval_err("Unbound symbol: '%s'", key->sym);
-}
+  /* the same numbers packed into a vector */
+  lval* args = lval_add(lval_sexpr(), bench_range(n));
+  lval* vec = builtin_vec(NULL, args);
 
-void lenv_put(lenv* env, lval* key, lval* val) {
-  for (int i = 0; i < env->count; i++) {
-    if (strcmp(env->syms[i], key->sym) == 0) {
-      lval_del(env->vals[i]);
-      env->vals[i] = lval_copy(val);
-      return;
-    }
+  clock_t start = clock();
+  for (int r = 0; r < rounds / 10; r++) {
+    lval_del(builtin_vsum(NULL, lval_add(lval_sexpr(), lval_ref(vec))));
   }
+  printf("%-24s %10.3f s\n", "vsum (builtin_vsum)", bench_seconds(start));
 
-  env->count++;
-  env->syms = realloc(env->syms, sizeof(char*) * env->count);
-  env->vals = realloc(env->vals, sizeof(lval*) * env->count);
+  start = clock();
+  for (int r = 0; r < rounds / 10; r++) {
+    args = lval_add(lval_add(lval_sexpr(), lval_ref(vec)), lval_ref(vec));
+    lval_del(builtin_vdot(NULL, args));
+  }
+  printf("%-24s %10.3f s\n", "vdot (builtin_vdot)", bench_seconds(start));
 
-  env->syms[env->count - 1] = malloc(strlen(key->sym) + 1);
-  strcpy(env->syms[env->count - 1], key->sym);
+  start = clock();
+  for (int r = 0; r < rounds / 10; r++) {
+    args = lval_add(lval_add(lval_sexpr(), lval_ref(vec)), lval_num(1));
+    lval_del(builtin_vmap_add(NULL, args));
+  }
+  printf("%-24s %10.3f s\n", "vmap+ (builtin_vmap_add)", bench_seconds(start));
 
-  env->vals[env->count - 1] = lval_copy(val);
+  lval_del(vec);
 }
 
+/* 10000! three ways, then printing it */
+void bench_bignum(void) {
+  int n = 10000;
+
+  clock_t start = clock();
+  lbig acc = lbig_alloc(1, 1);
+  acc.digits[0] = 1;
+  acc.size = 1;
+  for (int i = 2; i <= n; i++) {
+    lbig factor;
+    lbig_of(lval_num(i), &factor);
+    lbig next = lbig_mul(&acc, &factor);
+    free(acc.digits);
+    acc = next;
+  }
+  printf("%-24s %10.3f s\n", "10000! one at a time", bench_seconds(start));
+  free(acc.digits);
+
+  /* the same product tree as '*', with and without Karatsuba */
+  lval* args = lval_sexpr();
+  for (int i = 1; i <= n; i++) { args = lval_add(args, lval_num(i)); }
+
+  int karatsuba = lbig_karatsuba_digits;
+  lbig_karatsuba_digits = INT_MAX;
+  start = clock();
+  lval_del(lval_arith_big(lval_ref(args), '*'));
+  printf("%-24s %10.3f s\n", "10000! tree, schoolbook", bench_seconds(start));
+  lbig_karatsuba_digits = karatsuba;
+
+  start = clock();
+  lval* result = builtin_mul(NULL, args);
+  printf("%-24s %10.3f s\n", "10000! tree (builtin_mul)", bench_seconds(start));
+
+  lbig big;
+  lbig_of(result, &big);
+  start = clock();
+  char* str = NULL;
+  for (int r = 0; r < 100; r++) {
+    free(str);
+    str = lbig_string(&big);
+  }
+  printf("%-24s %10.3f s  (%zu characters)\n", "print 10000! x100",
+         bench_seconds(start), strlen(str));
 
-// Read
+  start = clock();
+  for (int r = 0; r < 100; r++) {
+    lbig parsed = lbig_parse(str);
+    free(parsed.digits);
+  }
+  printf("%-24s %10.3f s\n", "read 10000! x100", bench_seconds(start));
 
-lval* lval_read_num(mpc_ast_t* tree) {
-  errno = 0;
-  long x = strtol(tree->contents, NULL, 10);
-  return errno != ERANGE
-    ? lval_num(x)
-    : lval_err("invalid number");
+  free(str);
+  lval_del(result);
 }
 
-lval* lval_read(mpc_ast_t* tree) {
-  if (strstr(tree->tag, "number")) { return lval_read_num(tree); }
-  if (strstr(tree->tag, "symbol")) { return lval_sym(tree->contents); }
+/* doubles through '+' and the vector and math builtins */
+void bench_float(void) {
+  int n = 1000000;
+  int rounds = 10;
 
-  lval* result = NULL;
-  if (strcmp(tree->tag, ">") == 0) { result = lval_sexpr(); }
-  if (strstr(tree->tag, "sexpr")) { result = lval_sexpr(); }
-  if (strstr(tree->tag, "qexpr")) { result = lval_qexpr(); }
+  lval* args = lval_qexpr();
+  for (int i = 0; i < n; i++) { args = lval_add(args, lval_dbl(i * 0.5)); }
+
+  /* flonums and an unboxed accumulator: no allocation past the result */
+  long allocated = heap.allocated;
+  clock_t start = clock();
+  for (int r = 0; r < rounds; r++) {
+    lval_del(builtin_add(NULL, lval_ref(args)));
+  }
+  printf("%-24s %10.3f s  (%li allocations)\n", "+ (builtin_add)",
+         bench_seconds(start), heap.allocated - allocated);
+
+  double* xs = malloc(sizeof(double) * n);
+  double* out = malloc(sizeof(double) * n);
+  for (int i = 0; i < n; i++) { xs[i] = i * 0.5; }
+
+  for (int k = 0; k < LKERNEL_SET_COUNT; k++) {
+    lkernels* kernels = &lkernel_sets[k];
+    if (!lkernels_supported(kernels)) { continue; }
+
+    char label[32];
+    start = clock();
+    for (int r = 0; r < rounds * 10; r++) { kernels->sqrt(xs, out, n); }
+    snprintf(label, sizeof(label), "sqrt (%s)", kernels->name);
+    printf("%-24s %10.3f s\n", label, bench_seconds(start));
+
+    double total = 0;
+    start = clock();
+    for (int r = 0; r < rounds * 10; r++) { total += kernels->fsum(xs, n); }
+    snprintf(label, sizeof(label), "sum (%s)", kernels->name);
+    printf("%-24s %10.3f s  (%g)\n", label, bench_seconds(start), total);
+  }
+  free(xs);
+  free(out);
+
+  lval* vec = builtin_vec(NULL, lval_add(lval_sexpr(), lval_ref(args)));
+  lval_del(args);
+
+  lbuiltin ops[] = { builtin_sqrt, builtin_exp, builtin_log };
+  char* names[] = { "sqrt (vector)", "exp (vector)", "log (vector)" };
+  for (int k = 0; k < 3; k++) {
+    start = clock();
+    for (int r = 0; r < rounds; r++) {
+      lval_del(ops[k](NULL, lval_add(lval_sexpr(), lval_ref(vec))));
+    }
+    printf("%-24s %10.3f s\n", names[k], bench_seconds(start));
+  }
+
+  start = clock();
+  for (int r = 0; r < rounds; r++) {
+    args = lval_add(lval_add(lval_sexpr(), lval_ref(vec)), lval_dbl(1.5));
+    lval_del(builtin_pow(NULL, args));
+  }
+  printf("%-24s %10.3f s\n", "pow (vector)", bench_seconds(start));
+
+  lval_del(vec);
+}
 
-  for (int i = 0; i < tree->children_num; i++) {
-    if (strcmp(tree->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(tree->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(tree->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(tree->children[i]->contents, "}") == 0) { continue; }
+/* one compiled expression run over and over, like the body of a loop */
+void bench_lookup(void) {
+  int runs = 1000000;
 
-    if (strcmp(tree->children[i]->tag, "regex") == 0) { continue; }
+  lenv* env = lenv_new();
+  lenv_add_all_builtins(env);
 
-    result = lval_add(result, lval_read(tree->children[i]));
+  /* enough other globals that probing isn't free */
+  char name[32];
+  for (int i = 0; i < 4096; i++) {
+    snprintf(name, sizeof(name), "global%i", i);
+    lenv_put(env, lval_sym(name), lval_num(i));
   }
 
-  return result;
+  char* names[] = { "a", "b", "c", "d" };
+  for (int i = 0; i < 4; i++) {
+    lenv_put(env, lval_sym(names[i]), lval_num(i + 1));
+  }
+
+  /* (+ a (* b c) d) */
+  lval* product = lval_sexpr();
+  product = lval_add(product, lval_sym("*"));
+  product = lval_add(product, lval_sym("b"));
+  product = lval_add(product, lval_sym("c"));
+  lval* expr = lval_sexpr();
+  expr = lval_add(expr, lval_sym("+"));
+  expr = lval_add(expr, lval_sym("a"));
+  expr = lval_add(expr, product);
+  expr = lval_add(expr, lval_sym("d"));
+
+  for (int caching = 0; caching <= 1; caching++) {
+    lvm_caching = caching;
+    lchunk* chunk = lchunk_compile(expr, NULL);
+
+    clock_t start = clock();
+    for (int i = 0; i < runs; i++) {
+      lval_del(lvm_run(env, chunk, NULL));
+    }
+    printf("%-24s %10.3f s\n",
+           caching ? "(+ a (* b c) d) cached" : "(+ a (* b c) d) lenv_get",
+           bench_seconds(start));
+
+    lchunk_del(chunk);
+  }
+
+  lvm_caching = 1;
+  lval_del(expr);
+  lenv_del(env);
 }
 
+/* lambda calls from source; loop is all tail calls, sum none */
+void bench_calls(void) {
+  lenv* env = lenv_new();
+  lenv_add_all_builtins(env);
 
-// Print
+  char* defs[] = {
+    "def {loop} (\\ {n acc} {if (== n 0) {acc} {loop (- n 1) (+ acc n)}})",
+    "def {sum} (\\ {n} {if (== n 0) {0} {+ n (sum (- n 1))}})",
+    /* add1 reads k out of what it captured from adder */
+    "def {adder} (\\ {k} {\\ {x} {+ x k}})",
+    "def {add1} (adder 1)",
+    "def {count} (\\ {n acc} {if (== n 0) {acc} {count (- n 1) (add1 acc)}})",
+  };
+  for (int i = 0; i < 5; i++) {
+    lval_del(lval_run(env, lval_read_string(defs[i])));
+  }
 
-void lval_print(lval* val);
-void lval_expr_print(lval* val, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < val->count; i++) {
-    lval_print(val->cell[i]);
-    if (i != (val->count - 1)) { putchar(' '); }
+  for (int walk = 0; walk <= 1; walk++) {
+    vm_disabled = walk;
+
+    clock_t start = clock();
+    lval* result = lval_run(env, lval_read_string("loop 1000000 0"));
+    printf("%-24s %10.3f s  ", walk ? "loop, tree-walk" : "loop, vm",
+           bench_seconds(start));
+    lval_println(result);
+    lval_del(result);
+
+    start = clock();
+    result = lval_run(env, lval_read_string("count 1000000 0"));
+    printf("%-24s %10.3f s  ", walk ? "closure, tree-walk" : "closure, vm",
+           bench_seconds(start));
+    lval_println(result);
+    lval_del(result);
   }
-  putchar(close);
+  vm_disabled = 0;
+
+  clock_t start = clock();
+  lval* result = lval_run(env, lval_read_string("sum 100000"));
+  printf("%-24s %10.3f s  ", "sum, vm", bench_seconds(start));
+  lval_println(result);
+  lval_del(result);
+
+  lenv_del(env);
 }
-void lval_print(lval* val) {
-  switch (val->type) {
-    case LVAL_ERR: printf("Error: %s", val->err); break;
-    case LVAL_NUM: printf("%li", val->num); break;
-    case LVAL_SYM: printf("%s", val->sym); break;
-    case LVAL_FUN: printf("<function>"); break;
-    case LVAL_SEXPR: lval_expr_print(val, '(', ')'); break;
-    case LVAL_QEXPR: lval_expr_print(val, '{', '}'); break;
+
+/* numeric loops with and without native code */
+void bench_jit(void) {
+  char* defs[] = {
+    "def {loop} (\\ {n acc} {if (== n 0) {acc} {loop (- n 1) (+ acc n)}})",
+    "def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})",
+  };
+  char* runs[] = { "loop 3000000 0", "fib 25" };
+  unsigned long threshold = jit.threshold;
+
+  for (int i = 0; i < 2; i++) {
+    for (int native = 0; native <= 1; native++) {
+      /* a fresh environment, so nothing is compiled yet */
+      lenv* env = lenv_new();
+      lenv_add_all_builtins(env);
+      jit.threshold = native ? threshold : 0;
+      lval_del(lval_run(env, lval_read_string(defs[i])));
+
+      clock_t start = clock();
+      lval* result = lval_run(env, lval_read_string(runs[i]));
+      printf("%-16s %-8s %10.3f s  ", runs[i], native ? "jit" : "vm",
+             bench_seconds(start));
+      lval_println(result);
+      lval_del(result);
+      lenv_del(env);
+    }
   }
+
+  jit.threshold = threshold;
 }
 
-void lval_println(lval* val) {
-  lval_print(val);
-  putchar('\n');
+/* a generated config line full of constant expressions, run over and
+   over like the REPL would run it, with and without folding */
+void bench_fold(void) {
+  char* line = "def {limits} (list (* 60 60 24) (* 1024 1024 (+ 4 4)) "
+               "(/ (* 7 24) 24) (head {5 6 7}) (join {1 2} (tail {0 3 4})))";
+
+  for (int fold = 0; fold <= 1; fold++) {
+    lenv* env = lenv_new();
+    lenv_add_all_builtins(env);
+    lfold.enabled = fold;
+
+    lval* read = lval_read_string(line);
+    clock_t start = clock();
+    for (int i = 0; i < 200000; i++) {
+      lval_del(lval_run(env, lfold_line(env, lval_ref(read))));
+    }
+    printf("%-24s %10.3f s  ", fold ? "config, folded" : "config",
+           bench_seconds(start));
+    lval* result = lval_run(env, lval_read_string("limits"));
+    lval_println(result);
+    lval_del(result);
+    lval_del(read);
+    lenv_del(env);
+  }
+
+  lfold.enabled = 1;
 }
 
+/* a loop that runs code kept as a Q-expression, compiling it each time
+   or once */
+void bench_eval(void) {
+  char* defs[] = {
+    "def {acc} 0",
+    "def {step} {def {acc} (+ acc (* 2 (- 10 (/ 8 (+ 1 1)))))}",
+    "def {loop} (\\ {n} {if (== n 0) {acc} {next (eval step) n}})",
+    "def {next} (\\ {_ n} {loop (- n 1)})",
+  };
+
+  for (int cached = 0; cached <= 1; cached++) {
+    lenv* env = lenv_new();
+    lenv_add_all_builtins(env);
+    lquoted_cache.enabled = cached;
+    for (int i = 0; i < 4; i++) {
+      lval_del(lval_run(env, lval_read_string(defs[i])));
+    }
 
-// Eval
+    clock_t start = clock();
+    lval* result = lval_run(env, lval_read_string("loop 300000"));
+    printf("%-24s %10.3f s  ", cached ? "eval, cached" : "eval",
+           bench_seconds(start));
+    lval_println(result);
+    lval_del(result);
+    lenv_del(env);
+  }
+  printf("%-24s %lu hits, %lu misses\n", "eval cache",
+         lquoted_cache.hits, lquoted_cache.misses);
+
+  lquoted_cache.enabled = 1;
+}
 
-lval* lval_eval(lenv* env, lval* val);
+/* naive recursive fib, as it is and with its results remembered */
+void bench_memo(void) {
+  char* defs[] = {
+    "def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})",
+    "def {fib} (memo (\\ {n} "
+    "{if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))",
+  };
+
+  for (int memo = 0; memo <= 1; memo++) {
+    lenv* env = lenv_new();
+    lenv_add_all_builtins(env);
+    lval_del(lval_run(env, lval_read_string(defs[memo])));
+
+    clock_t start = clock();
+    lval* result = lval_run(env, lval_read_string("fib 30"));
+    printf("%-24s %10.3f s  ", memo ? "fib 30, memo" : "fib 30",
+           bench_seconds(start));
+    lval_println(result);
+    lval_del(result);
+
+    if (memo) {
+      result = lval_run(env, lval_read_string("memo-stats fib"));
+      printf("%-24s ", "memo-stats");
+      lval_println(result);
+      lval_del(result);
+    }
+    lenv_del(env);
+  }
+}
 
-#define LASSERT(args, cond, fmt, ...)         \
-  if (!(cond)) {                              \
-    lval* err = lval_err(fmt, ##__VA_ARGS__); \
-    lval_del(args);                           \
-    return err;                                    \
-  }                                           \
+typedef struct {
+  char* name;
+  void (*run)(void);
+} lbench;
+
+lbench benches[] = {
+  { "env", bench_env },
+  { "lookup", bench_lookup },
+  { "alloc", bench_alloc },
+  { "layout", bench_layout },
+  { "lists", bench_lists },
+  { "arith", bench_arith },
+  { "bignum", bench_bignum },
+  { "float", bench_float },
+  { "calls", bench_calls },
+  { "jit", bench_jit },
+  { "fold", bench_fold },
+  { "eval", bench_eval },
+  { "memo", bench_memo },
+};
 
+int bench_run(char* name) {
+  for (int i = 0; i < (int)(sizeof(benches) / sizeof(lbench)); i++) {
+    if (strcmp(benches[i].name, name) == 0) {
+      benches[i].run();
+      return 0;
+    }
+  }
 
-lval* builtin_add(lenv* env, lval* val) {
-  for (int i = 0; i < val->count; i++) {
-    LASSERT(val, val->cell[i]->type == LVAL_NUM,
-            "Function '+' passed a non-number");
+  fprintf(stderr, "Unknown benchmark '%s'\n", name);
+  return 1;
+}
+
+
+// Compile to C
+
+/*
+ * 'lispy --compile foo.lspy -o foo.c' translates a script, one REPL line
+ * per line of it, into a C program that includes this file for its
+ * runtime and prints what the REPL would have printed for each line. A
+ * line with brackets still open carries on into the next.
+ *
+ * A line '(def {f} (\ {x} {...}))' whose body makes no lambdas of its own
+ * also becomes a C function of its formals, which compiled code calls
+ * directly once the def has run. f itself is bound to the lambda as in
+ * the REPL, so it prints and compares the same, and is run by the
+ * interpreter when it is called as a value.
+ *
+ * Every expression in those functions and at the top level becomes C
+ * that evaluates it in place: locals are C variables, an if with its
+ * branches written out is a C if, a call in tail position to the
+ * function it is in is a loop, and calls to builtins and to compiled
+ * functions are direct C calls. Anything else is looked up and applied
+ * with lval_call, so it behaves exactly as it would in the REPL.
+ *
+ * A global is only bound at compile time if it can't be rebound. That
+ * means a builtin the script never defines, or a compiled function the
+ * script defines just once, and only while every def in the script
+ * names its symbols literally.
+ */
+
+/* every builtin, by the name lenv_add_all_builtins gives it and the name
+   of its C function for the code --compile generates */
+typedef struct {
+  char* name;
+  lbuiltin fun;
+  char* c_name;
+} lbuiltin_def;
+
+#define LBUILTIN(name, fun) { name, fun, #fun }
+
+lbuiltin_def lbuiltins[] = {
+  LBUILTIN("list", builtin_list),
+  LBUILTIN("head", builtin_head),
+  LBUILTIN("tail", builtin_tail),
+  LBUILTIN("cons", builtin_cons),
+  LBUILTIN("eval", builtin_eval),
+  LBUILTIN("join", builtin_join),
+  LBUILTIN("def", builtin_def),
+  LBUILTIN("\\", builtin_lambda),
+  LBUILTIN("if", builtin_if),
+
+  LBUILTIN("+", builtin_add),
+  LBUILTIN("*", builtin_mul),
+  LBUILTIN("-", builtin_sub),
+  LBUILTIN("/", builtin_div),
+
+  LBUILTIN("==", builtin_eq),
+  LBUILTIN("!=", builtin_ne),
+  LBUILTIN("<", builtin_lt),
+  LBUILTIN(">", builtin_gt),
+  LBUILTIN("<=", builtin_le),
+  LBUILTIN(">=", builtin_ge),
+
+  LBUILTIN("vec", builtin_vec),
+  LBUILTIN("vlen", builtin_vlen),
+  LBUILTIN("vsum", builtin_vsum),
+  LBUILTIN("vmap+", builtin_vmap_add),
+  LBUILTIN("vdot", builtin_vdot),
+  LBUILTIN("vslice", builtin_vslice),
+
+  LBUILTIN("sqrt", builtin_sqrt),
+  LBUILTIN("exp", builtin_exp),
+  LBUILTIN("log", builtin_log),
+  LBUILTIN("pow", builtin_pow),
+
+  LBUILTIN("memo", builtin_memo),
+  LBUILTIN("memo-stats", builtin_memo_stats),
+};
+
+#define LBUILTIN_COUNT ((int)(sizeof(lbuiltins) / sizeof(lbuiltin_def)))
+
+/*
+ * The runtime side, called from generated code. Compiled functions
+ * recurse on the C stack, and like the VM's call records they stop at
+ * ldepth.max (set with --max-depth here too). laot_init makes room for
+ * that many by raising the stack limit and starting the program over;
+ * where the limit can't go that high, they also stop short of its end.
+ */
+#define LAOT_FRAME 1024 /* bytes of C stack to allow for each call */
+
+struct {
+  uintptr_t base;
+  uintptr_t limit;
+  long depth;
+} laot;
+
+void laot_init(int argc, char** argv) {
+  for (int i = 1; i + 1 < argc; i++) {
+    if (strcmp(argv[i], "--max-depth") == 0) { ldepth.max = atol(argv[++i]); }
   }
 
-  lval* acc = lval_pop(val, 0);
-  
-  while (val->count > 0) {
-    lval* arg = lval_pop(val, 0);
-    acc->num += arg->num;
-    lval_del(arg);
+  rlim_t want = (rlim_t)ldepth.max * LAOT_FRAME + (8 << 20);
+  rlim_t size = 8 << 20;
+  struct rlimit stack;
+  if (getrlimit(RLIMIT_STACK, &stack) == 0) {
+    if (stack.rlim_max != RLIM_INFINITY && want > stack.rlim_max) {
+      want = stack.rlim_max;
+    }
+    size = stack.rlim_cur;
+    if (size != RLIM_INFINITY && size < want) {
+      /* the stack's size is fixed when the program starts */
+      stack.rlim_cur = want;
+      if (setrlimit(RLIMIT_STACK, &stack) == 0) {
+        execv("/proc/self/exe", argv);
+      }
+    }
   }
+  if (size == RLIM_INFINITY || size > want) { size = want; }
 
-  lval_del(val);
-  return acc;
+  /* argv is on the stack above main's frame */
+  laot.base = (uintptr_t)argv;
+  laot.limit = size - size / 4;
 }
 
-lval* builtin_mul(lenv* env, lval* val) {
-  for (int i = 0; i < val->count; i++) {
-    LASSERT(val, val->cell[i]->type == LVAL_NUM,
-            "Function '*' passed a non-number");
+/* counts a call to a compiled function, or returns the error for one
+   call too many; the function takes one off laot.depth on return */
+lval* laot_enter(void) {
+  char here;
+  if (laot.depth >= ldepth.max || laot.base - (uintptr_t)&here > laot.limit) {
+    return lval_err("Maximum depth of %li exceeded", ldepth.max);
   }
+  laot.depth++;
+  return NULL;
+}
 
-  lval* acc = lval_pop(val, 0);
-  
-  while (val->count > 0) {
-    lval* arg = lval_pop(val, 0);
-    acc->num *= arg->num;
-    lval_del(arg);
+/* the first error among n values, with the rest released; or NULL */
+lval* laot_error(int n, lval** vals) {
+  for (int i = 0; i < n; i++) {
+    if (lval_type_of(vals[i]) == LVAL_ERR) {
+      for (int j = 0; j < n; j++) {
+        if (j != i) { lval_del(vals[j]); }
+      }
+      return vals[i];
+    }
   }
+  return NULL;
+}
 
-  lval_del(val);
-  return acc;
+lval* laot_list(int type, int n, lval** vals) {
+  lval* list = type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+  if (n > 0) { lval_reserve(list, n); }
+  for (int i = 0; i < n; i++) { lval_add(list, vals[i]); }
+  return list;
 }
 
-lval* builtin_sub(lenv* env, lval* val) {
-  for (int i = 0; i < val->count; i++) {
-    LASSERT(val, val->cell[i]->type == LVAL_NUM,
-            "Function '-' passed a non-number");
+/* calls fun on n evaluated arguments, like lvm_call would; consumes them */
+lval* laot_apply(lenv* env, lbuiltin fun, int n, lval** vals) {
+  lgc_poll();
+  lcaller = NULL;
+  lval* err = laot_error(n, vals);
+  if (err) { return err; }
+  return fun(env, laot_list(LVAL_SEXPR, n, vals));
+}
+
+/*
+ * Two-argument arithmetic and comparisons, which skip building a list for
+ * builtin_add and friends when both arguments are fixnums. Their sums and
+ * differences can't overflow a long.
+ */
+#define LAOT_BINARY(name, fun, fast)                               \
+  lval* name(lenv* env, lval* a, lval* b) {                        \
+    if (lval_is_fixnum(a) && lval_is_fixnum(b)) {                  \
+      long x = lval_num_of(a);                                     \
+      long y = lval_num_of(b);                                     \
+      fast                                                         \
+    }                                                              \
+    return laot_apply(env, fun, 2, (lval*[]){ a, b });             \
   }
 
-  lval* acc = lval_pop(val, 0);
+LAOT_BINARY(laot_add, builtin_add, return lval_num(x + y);)
+LAOT_BINARY(laot_sub, builtin_sub, return lval_num(x - y);)
+LAOT_BINARY(laot_mul, builtin_mul,
+            long z;
+            if (!__builtin_mul_overflow(x, y, &z)) { return lval_num(z); })
+LAOT_BINARY(laot_eq, builtin_eq, return lval_num(x == y);)
+LAOT_BINARY(laot_ne, builtin_ne, return lval_num(x != y);)
+LAOT_BINARY(laot_lt, builtin_lt, return lval_num(x < y);)
+LAOT_BINARY(laot_gt, builtin_gt, return lval_num(x > y);)
+LAOT_BINARY(laot_le, builtin_le, return lval_num(x <= y);)
+LAOT_BINARY(laot_ge, builtin_ge, return lval_num(x >= y);)
+
+struct {
+  lbuiltin fun;
+  char* c_name;
+} laot_binaries[] = {
+  { builtin_add, "laot_add" }, { builtin_sub, "laot_sub" },
+  { builtin_mul, "laot_mul" }, { builtin_eq, "laot_eq" },
+  { builtin_ne, "laot_ne" }, { builtin_lt, "laot_lt" },
+  { builtin_gt, "laot_gt" }, { builtin_le, "laot_le" },
+  { builtin_ge, "laot_ge" },
+};
 
-  // unary minus
-  if (val->count == 0) {
-    acc->num = -acc->num;
+#define LAOT_BINARY_COUNT \
+  ((int)(sizeof(laot_binaries) / sizeof(*laot_binaries)))
+
+/* the same for any function value, which may be an error itself */
+lval* laot_call(lenv* env, lval* fn, int n, lval** vals) {
+  lgc_poll();
+  lcaller = NULL;
+  if (lval_type_of(fn) == LVAL_ERR) {
+    for (int i = 0; i < n; i++) { lval_del(vals[i]); }
+    return fn;
+  }
+  lval* err = laot_error(n, vals);
+  if (err) {
+    lval_del(fn);
+    return err;
   }
+  return lval_call(env, fn, laot_list(LVAL_SEXPR, n, vals));
+}
+
+/*
+ * The compiler side. Generated code is printed to stdout, which
+ * laot_compile_file points at the output file.
+ */
+typedef struct {
+  char* name;  /* interned */
+  int line;    /* of its def */
+  lval* body;
+  int fixed;
+  int variadic;
+  char** params; /* interned, the rest list last */
+} laot_fn;
+
+struct {
+  int dynamic; /* some def's symbols aren't known until it runs */
+  int name_count;
+  char** names;
+  int* defs;   /* how many times each name is def'd */
+
+  int fn_count;
+  laot_fn* fns;
+
+  int const_count;
+  lval** consts;
+
+  laot_fn* current; /* being emitted, or NULL at the top level */
+  int temps;
+  int indent;
+} lemit;
+
+void lemit_line(char* fmt, ...) {
+  printf("%*s", lemit.indent * 2, "");
+  va_list args;
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  putchar('\n');
+}
 
-  while (val->count > 0) {
-    lval* arg = lval_pop(val, 0);
-    acc->num -= arg->num;
-    lval_del(arg);
+int lemit_defs(char* name) {
+  for (int i = 0; i < lemit.name_count; i++) {
+    if (lemit.names[i] == name) { return lemit.defs[i]; }
   }
+  return 0;
+}
 
-  lval_del(val);
-  return acc;
+void lemit_count_def(char* name) {
+  for (int i = 0; i < lemit.name_count; i++) {
+    if (lemit.names[i] == name) { lemit.defs[i]++; return; }
+  }
+  lemit.name_count++;
+  lemit.names = realloc(lemit.names, sizeof(char*) * lemit.name_count);
+  lemit.defs = realloc(lemit.defs, sizeof(int) * lemit.name_count);
+  lemit.names[lemit.name_count - 1] = name;
+  lemit.defs[lemit.name_count - 1] = 1;
 }
 
-lval* builtin_div(lenv* env, lval* val) {
+int lval_is_sym_list(lval* val) {
+  if (lval_type_of(val) != LVAL_QEXPR) { return 0; }
   for (int i = 0; i < val->count; i++) {
-    LASSERT(val, val->cell[i]->type == LVAL_NUM,
-            "Function '/' passed a non-number");
+    if (lval_type_of(val->cell[i]) != LVAL_SYM) { return 0; }
   }
+  return 1;
+}
 
-  lval* acc = lval_pop(val, 0);
-  
-  while (val->count > 0) {
-    lval* arg = lval_pop(val, 0);
+/* counts the defs anywhere in val, quoted or not, and notes any whose
+   symbols can't be read off the source */
+void lemit_scan(lval* val) {
+  lstack pending = { 0 };
+  if (lval_type_of(val) == LVAL_SEXPR) { lstack_push(&pending, val); }
+
+  while (pending.count > 0) {
+    lval* list = lstack_pop(&pending);
+    for (int i = 0; i < list->count; i++) {
+      lval* item = list->cell[i];
+      int type = lval_type_of(item);
+      if (type == LVAL_SEXPR || type == LVAL_QEXPR) {
+        lstack_push(&pending, item);
+      }
+      if (!lval_is_keyword(item, keywords.define)) { continue; }
 
-    if (arg->num == 0) {
-      lval_del(arg);
-      lval_del(acc);
-      acc = lval_err("division by zero");
-      break;
+      if (i != 0 || list->count < 2 || !lval_is_sym_list(list->cell[1])) {
+        lemit.dynamic = 1;
+        continue;
+      }
+      for (int j = 0; j < list->cell[1]->count; j++) {
+        lemit_count_def(lval_sym_of(list->cell[1]->cell[j]));
+      }
     }
+  }
+
+  free(pending.items);
+}
 
-    acc->num /= arg->num;
-    lval_del(arg);
+/* what a line reduces to before it is evaluated: '(x)' is just x */
+lval* lemit_strip(lval* val) {
+  while (lval_type_of(val) == LVAL_SEXPR && val->count == 1) {
+    val = val->cell[0];
   }
+  return val;
+}
 
-  lval_del(val);
-  return acc;
+int lemit_mentions_lambda(lval* val) {
+  lstack pending = { 0 };
+  int found = 0;
+  lstack_push(&pending, val);
+  while (pending.count > 0 && !found) {
+    lval* list = lstack_pop(&pending);
+    for (int i = 0; i < list->count; i++) {
+      int type = lval_type_of(list->cell[i]);
+      if (type == LVAL_SEXPR || type == LVAL_QEXPR) {
+        lstack_push(&pending, list->cell[i]);
+      }
+      if (lval_is_keyword(list->cell[i], keywords.lambda)) { found = 1; }
+    }
+  }
+  free(pending.items);
+  return found;
 }
 
-lval* builtin_head(lenv* env, lval* val) {
-  LASSERT(val, val->count == 1,
-          "Function 'head' passed too many arguments. ",
-          "Got %i, expected %i",
-          val->count, 1);
-  LASSERT(val, val->cell[0]->type == LVAL_QEXPR,
-          "Function 'head' passed incorrect type for argument 0"
-          "Got %s, Expected %s",
-          ltype_name(val->cell[0]->type), ltype_name(LVAL_QEXPR));
-  LASSERT(val, val->cell[0]->count != 0,
-          "Function 'head' passed '{}'");
+/* records form as a compiled function for name if it can be one */
+void lemit_find_fn(char* name, lval* form, int line) {
+  if (lval_type_of(form) != LVAL_SEXPR || form->count != 3
+      || !lval_is_keyword(form->cell[0], keywords.lambda)
+      || !lval_is_sym_list(form->cell[1])
+      || lval_type_of(form->cell[2]) != LVAL_QEXPR
+      || lemit_mentions_lambda(form->cell[2])) {
+    return;
+  }
 
-  lval* result = lval_take(val, 0);
-  while (result->count > 1) {
-    lval_del(lval_pop(result, 1));
+  /* '&' has to be followed by exactly one symbol, as in lval_close */
+  lval* formals = form->cell[1];
+  for (int i = 0; i < formals->count; i++) {
+    if (lval_is_keyword(formals->cell[i], keywords.rest)
+        && i != formals->count - 2) {
+      return;
+    }
   }
 
-  return result;
+  lemit.fns = realloc(lemit.fns, sizeof(laot_fn) * (lemit.fn_count + 1));
+  laot_fn* fn = &lemit.fns[lemit.fn_count++];
+  fn->name = name;
+  fn->line = line;
+  fn->body = form->cell[2];
+  fn->fixed = 0;
+  fn->variadic = 0;
+  fn->params = malloc(sizeof(char*) * (formals->count + 1));
+  for (int i = 0; i < formals->count; i++) {
+    if (lval_is_keyword(formals->cell[i], keywords.rest)) {
+      fn->variadic = 1;
+      continue;
+    }
+    fn->params[fn->fixed++] = lval_sym_of(formals->cell[i]);
+  }
+  fn->fixed -= fn->variadic;
 }
 
-lval* builtin_tail(lenv* env, lval* val) {
-  LASSERT(val, val->count == 1,
-          "Function 'tail' passed too many arguments");
-  LASSERT(val, val->cell[0]->type == LVAL_QEXPR,
-          "Function 'tail' passed incorrect type");
-  LASSERT(val, val->cell[0]->count != 0,
-          "Function 'tail' passed '{}'");
+/* the compiled function sym is statically bound to, or NULL */
+laot_fn* lemit_fn_of(lval* sym) {
+  char* name = lval_sym_of(sym);
+  if (lemit.dynamic || lemit_defs(name) != 1) { return NULL; }
+  for (int i = 0; i < lemit.fn_count; i++) {
+    if (lemit.fns[i].name == name) { return &lemit.fns[i]; }
+  }
+  return NULL;
+}
 
-  lval* result = lval_take(val, 0);
-  lval_del(lval_pop(result, 0));
+lbuiltin_def* lemit_builtin_of(lval* sym) {
+  char* name = lval_sym_of(sym);
+  if (lemit.dynamic || lemit_defs(name) != 0) { return NULL; }
+  for (int i = 0; i < LBUILTIN_COUNT; i++) {
+    if (strcmp(lbuiltins[i].name, name) == 0) { return &lbuiltins[i]; }
+  }
+  return NULL;
+}
 
-  return result;
+/* the parameter of the current function sym names, or -1 */
+int lemit_param(lval* sym) {
+  laot_fn* fn = lemit.current;
+  if (!fn) { return -1; }
+  int count = fn->fixed + fn->variadic;
+  for (int i = count - 1; i >= 0; i--) {
+    if (fn->params[i] == lval_sym_of(sym)) { return i; }
+  }
+  return -1;
 }
 
-lval* builtin_list(lenv* env, lval* val) {
-  val->type = LVAL_QEXPR;
-  return val;
+int lemit_const(lval* val) {
+  lemit.const_count++;
+  lemit.consts = realloc(lemit.consts, sizeof(lval*) * lemit.const_count);
+  lemit.consts[lemit.const_count - 1] = val;
+  return lemit.const_count - 1;
 }
 
-lval* builtin_eval(lenv* env, lval* val) {
-  LASSERT(val, val->count == 1,
-          "Function 'eval' passed too many arguments");
-  LASSERT(val, val->cell[0]->type == LVAL_QEXPR,
-          "Function 'eval' passed incorrect type");
+/* a C expression that builds val, as read from the source */
+void lemit_value(lval* val) {
+  switch (lval_type_of(val)) {
+    case LVAL_NUM: {
+      long x = lval_num_of(val);
+      if (x == LONG_MIN) { printf("lval_num(LONG_MIN)"); }
+      else { printf("lval_num(%ldL)", x); }
+      break;
+    }
 
-  lval* result = lval_take(val, 0);
-  result->type = LVAL_SEXPR;
-  return lval_eval(env, result);
-}
+    case LVAL_DBL: {
+      double x = lval_dbl_of(val);
+      if (isinf(x)) { printf("lval_dbl(%sHUGE_VAL)", x < 0 ? "-" : ""); }
+      else { printf("lval_dbl(%a)", x); }
+      break;
+    }
 
-lval* lval_join(lval* left, lval* right) {
-  while (right->count) {
-    left = lval_add(left, lval_pop(right, 0));
-  }
+    case LVAL_BIG:
+      printf("lval_big(lbig_parse(\"");
+      lval_print(val);
+      printf("\"))");
+      break;
 
-  lval_del(right);
-  return left;
+    case LVAL_SYM:
+      printf("lval_sym(\"");
+      for (char* c = lval_sym_of(val); *c; c++) {
+        if (*c == '\\' || *c == '"') { putchar('\\'); }
+        putchar(*c);
+      }
+      printf("\")");
+      break;
+
+    default:
+      printf("laot_list(%s, %d, ", lval_type_of(val) == LVAL_QEXPR
+             ? "LVAL_QEXPR" : "LVAL_SEXPR", val->count);
+      if (val->count == 0) { printf("NULL"); }
+      else { printf("(lval*[]){ "); }
+      for (int i = 0; i < val->count; i++) {
+        if (i > 0) { printf(", "); }
+        lemit_value(val->cell[i]);
+      }
+      printf(val->count ? " })" : ")");
+      break;
+  }
 }
-lval* builtin_join(lenv* env, lval* val) {
-  for (int i = 0; i < val->count; i++) {
-    LASSERT(val, val->cell[i]->type == LVAL_QEXPR,
-            "Function 'join' passed incorrect type");
+
+int lemit_expr(lval* val, int tail);
+
+/* emits each of vals into a temp and prints them into list as a C
+   array; returns the temps, which the caller frees */
+int* lemit_args(lval** vals, int n, char* list) {
+  int* temps = malloc(sizeof(int) * n);
+  for (int i = 0; i < n; i++) { temps[i] = lemit_expr(vals[i], 0); }
+
+  char* at = list + sprintf(list, "(lval*[]){ ");
+  for (int i = 0; i < n; i++) {
+    at += sprintf(at, i ? ", t%d" : "t%d", temps[i]);
   }
+  sprintf(at, " }");
+  return temps;
+}
 
-  lval* result = lval_pop(val, 0);
+/* the branch of an if, a Q-expression, evaluated as an S-expression */
+int lemit_branch(lval* branch, int tail) {
+  lval* expr = lval_unquote(branch);
+  int result = lemit_expr(expr, tail);
+  lval_del(expr);
+  return result;
+}
 
-  while (val->count) {
-    result = lval_join(val, lval_pop(val, 0));
+int lemit_call(lval* val, int tail) {
+  int n = val->count - 1;
+  int result = lemit.temps++;
+  char* list = malloc(16 * (n + 1) + 16);
+
+  lval* head = val->cell[0];
+  int local = lval_type_of(head) != LVAL_SYM || lemit_param(head) >= 0;
+  laot_fn* fn = local ? NULL : lemit_fn_of(head);
+  lbuiltin_def* builtin = local ? NULL : lemit_builtin_of(head);
+  if (fn && (fn->variadic || fn->fixed != n)) { fn = NULL; }
+
+  int f = fn || builtin ? -1 : lemit_expr(head, 0);
+  int* args = lemit_args(val->cell + 1, n, list);
+
+  if (fn && tail && fn == lemit.current) {
+    /* the function itself, in tail position: rebind and go round again */
+    lemit_line("lval* t%d = laot_error(%d, %s);", result, n, list);
+    lemit_line("if (!t%d) {", result);
+    for (int i = 0; i < n; i++) { lemit_line("  lval_del(a%d);", i); }
+    for (int i = 0; i < n; i++) { lemit_line("  a%d = t%d;", i, args[i]); }
+    lemit_line("  continue;");
+    lemit_line("}");
+  } else if (fn) {
+    /* until its def has run, it is unbound like any other global */
+    int index = fn - lemit.fns;
+    lemit_line("lval* t%d = laot_error(%d, %s);", result, n, list);
+    lemit_line("if (!t%d && !lf%d_on) {", result, index);
+    lemit_line("  t%d = laot_call(env, lenv_get(env, k[%d]), %d, %s);",
+               result, lemit_const(head), n, list);
+    lemit_line("} else if (!t%d) {", result);
+    /* like the VM's tail calls, one here doesn't count towards the depth */
+    if (tail) { lemit_line("  laot.depth--;"); }
+    printf("%*s  t%d = lf%d(env", lemit.indent * 2, "", result, index);
+    for (int i = 0; i < n; i++) { printf(", t%d", args[i]); }
+    printf(");\n");
+    if (tail) { lemit_line("  laot.depth++;"); }
+    lemit_line("}");
+  } else if (builtin) {
+    char* binary = NULL;
+    for (int i = 0; n == 2 && i < LAOT_BINARY_COUNT; i++) {
+      if (laot_binaries[i].fun == builtin->fun) {
+        binary = laot_binaries[i].c_name;
+      }
+    }
+    if (binary) {
+      lemit_line("lval* t%d = %s(env, t%d, t%d);",
+                 result, binary, args[0], args[1]);
+    } else {
+      lemit_line("lval* t%d = laot_apply(env, %s, %d, %s);",
+                 result, builtin->c_name, n, list);
+    }
+  } else {
+    lemit_line("lval* t%d = laot_call(env, t%d, %d, %s);",
+               result, f, n, list);
   }
 
-  lval_del(val);
+  free(args);
+  free(list);
   return result;
 }
 
-lval* builtin_def(lenv* env, lval* val) {
-  LASSERT(val, val->cell[0]->type == LVAL_QEXPR,
-          "Function 'def' passed incorrect type");
+/* emits C that evaluates val into a new temp, and returns its number */
+int lemit_expr(lval* val, int tail) {
+  int result;
+
+  switch (lval_type_of(val)) {
+    case LVAL_SYM: {
+      int param = lemit_param(val);
+      result = lemit.temps++;
+      if (param >= 0) {
+        lemit_line("lval* t%d = lval_ref(a%d);", result, param);
+      } else {
+        lemit_line("lval* t%d = lenv_get(env, k[%d]);",
+                   result, lemit_const(val));
+      }
+      return result;
+    }
 
-  lval* syms = val->cell[0];
-  for (int i = 0; i < syms->count; i++) {
-    LASSERT(val, syms->cell[i]->type == LVAL_SYM,
-            "Function 'def' given a non-symbol");
-  }
+    case LVAL_SEXPR:
+      if (val->count == 0) { break; }
+      if (val->count == 1) { return lemit_expr(val->cell[0], tail); }
+
+      if (lval_is_form(val, keywords.cond, 4)
+          && lemit_param(val->cell[0]) < 0) {
+        int cond = lemit_expr(val->cell[1], 0);
+        result = lemit.temps++;
+        lemit_line("lval* t%d = NULL;", result);
+        lemit_line("int c%d = lval_is_number(t%d) ? lval_is_true(t%d) : -1;",
+                   result, cond, cond);
+        lemit_line("if (c%d < 0) {", result);
+        lemit_line("  t%d = lval_type_of(t%d) == LVAL_ERR ? lval_ref(t%d)",
+                   result, cond, cond);
+        lemit_line("    : lval_err(\"Function 'if' passed incorrect type\");");
+        lemit_line("}");
+        lemit_line("lval_del(t%d);", cond);
+
+        for (int branch = 2; branch <= 3; branch++) {
+          lemit_line(branch == 2 ? "if (c%d > 0) {" : "} else if (c%d == 0) {",
+                     result);
+          lemit.indent++;
+          int value = lemit_branch(val->cell[branch], tail);
+          lemit_line("t%d = t%d;", result, value);
+          lemit.indent--;
+        }
+        lemit_line("}");
+        return result;
+      }
 
-  LASSERT(val, syms->count == val->count - 1,
-          "Function 'def' given incorrect number of arguments");
+      return lemit_call(val, tail);
 
-  for (int i = 0; i < syms->count; i++) {
-    lenv_put(env, syms->cell[i], val->cell[i + 1]);
+    case LVAL_NUM:
+      if (!lval_is_fixnum(val)) { break; }
+      result = lemit.temps++;
+      lemit_line("lval* t%d = lval_num(%ldL);", result, lval_num_of(val));
+      return result;
+
+    default: break;
   }
 
-  lval_del(val);
-  return lval_sexpr();
+  result = lemit.temps++;
+  if (lval_type_of(val) == LVAL_SEXPR) {
+    lemit_line("lval* t%d = lval_sexpr();", result);
+  } else {
+    lemit_line("lval* t%d = lval_ref(k[%d]);", result, lemit_const(val));
+  }
+  return result;
 }
 
+void lemit_fn(int index) {
+  laot_fn* fn = &lemit.fns[index];
+  int params = fn->fixed + fn->variadic;
+
+  lemit.current = fn;
+  lemit.temps = 0;
+
+  printf("\n/* %s */\n", fn->name);
+  printf("lval* lf%d(lenv* env", index);
+  for (int i = 0; i < params; i++) { printf(", lval* a%d", i); }
+  printf(") {\n");
+
+  lemit.indent = 1;
+  lemit_line("lval* err = laot_enter();");
+  lemit_line("if (err) {");
+  for (int i = 0; i < params; i++) { lemit_line("  lval_del(a%d);", i); }
+  lemit_line("  return err;");
+  lemit_line("}");
+  lemit_line("for (;;) {");
+  lemit.indent++;
+  int result = lemit_branch(fn->body, 1);
+  for (int i = 0; i < params; i++) { lemit_line("lval_del(a%d);", i); }
+  lemit_line("laot.depth--;");
+  lemit_line("return t%d;", result);
+  lemit.indent--;
+  lemit_line("}");
+  printf("}\n");
+
+  lemit.current = NULL;
+}
 
-lval* lval_eval_sexpr(lenv* env, lval* val) {
-  for (int i = 0; i < val->count; i++) {
-    val->cell[i] = lval_eval(env, val->cell[i]);
+/* compiles the script at path to C at out, or to stdout if out is NULL */
+int laot_compile_file(char* path, char* out) {
+  FILE* in = fopen(path, "r");
+  if (!in) {
+    fprintf(stderr, "Could not open '%s'\n", path);
+    return 1;
   }
 
-  for (int i = 0; i < val->count; i++) {
-    if (val->cell[i]->type == LVAL_ERR) {
-      return lval_take(val, i);
+  /* a REPL line, except that one whose brackets are still open goes on
+     into the lines after it, so a form can be split across them */
+  int line_count = 0;
+  lval** lines = NULL;
+  int* starts = NULL;
+  char* text = NULL;
+  size_t size = 0;
+  ssize_t length;
+  char* form = NULL;
+  size_t form_length = 0;
+  int unclosed = 0;
+  int number = 0;
+  int start = 1;
+  for (;;) {
+    length = getline(&text, &size, in);
+    if (length >= 0) {
+      if (form_length == 0) { start = number + 1; }
+      number++;
+      form = realloc(form, form_length + length + 1);
+      memcpy(form + form_length, text, length + 1);
+      form_length += length;
+      for (char* c = text; *c; c++) {
+        c = lval_read_skip(c);
+        if (!*c) { break; }
+        if (*c == '(' || *c == '{') { unclosed++; }
+        if (*c == ')' || *c == '}') { unclosed--; }
+      }
+      if (unclosed > 0) { continue; }
     }
-  }
+    if (form_length == 0) { break; }
 
-  /* check for the empty expr and a single expr */
-  if (val->count == 0) {
-    return val;
+    if (form[form_length - 1] == '\n') { form[form_length - 1] = '\0'; }
+    lval* line = lval_read_string(form);
+    if (lval_type_of(line) == LVAL_ERR) {
+      fprintf(stderr, "%s:%d: %s\n", path, start, line->err);
+      return 1;
+    }
+    lines = realloc(lines, sizeof(lval*) * (line_count + 1));
+    starts = realloc(starts, sizeof(int) * (line_count + 1));
+    lines[line_count] = line;
+    starts[line_count++] = start;
+    form_length = 0;
+    unclosed = 0;
   }
-  if (val->count == 1) {
-    return lval_take(val, 0);
+  free(form);
+  free(text);
+  fclose(in);
+
+  if (out && !freopen(out, "w", stdout)) {
+    fprintf(stderr, "Could not write '%s'\n", out);
+    return 1;
   }
 
-  /* ensure that the first val is a function */
-  lval* first = lval_pop(val, 0);
-  if (first->type != LVAL_FUN) {
-    lval_del(first);
-    lval_del(val);
-    return lval_err("S-expr does not start with a function");
+  for (int i = 0; i < line_count; i++) { lemit_scan(lines[i]); }
+
+  /* top-level '(def {f g} (\ ...) (\ ...))' */
+  for (int i = 0; i < line_count; i++) {
+    lval* line = lemit_strip(lines[i]);
+    if (lval_type_of(line) != LVAL_SEXPR || line->count < 2
+        || !lval_is_keyword(line->cell[0], keywords.define)
+        || !lval_is_sym_list(line->cell[1])
+        || line->cell[1]->count != line->count - 2) {
+      continue;
+    }
+    for (int j = 0; j < line->cell[1]->count; j++) {
+      lemit_find_fn(lval_sym_of(line->cell[1]->cell[j]), line->cell[j + 2], i);
+    }
   }
 
-  lval* result = first->fun(env, val);
-  lval_del(first);
-  return result;
-}
+  printf("/*\n * Compiled by lispy --compile from %s.\n", path);
+  printf(" * Build it next to lispy.c: cc -std=c99 <this file> mpc.c -lm\n");
+  printf(" */\n");
+  printf("#define LISPY_RUNTIME\n#include \"lispy.c\"\n\n");
+  printf("lval** k; /* constants, see init_consts */\n");
+  printf("void init_consts(void);\n");
+  for (int i = 0; i < lemit.fn_count; i++) {
+    printf("int lf%d_on;\n", i);
+    printf("lval* lf%d(lenv* env", i);
+    for (int j = 0; j < lemit.fns[i].fixed + lemit.fns[i].variadic; j++) {
+      printf(", lval* a%d", j);
+    }
+    printf(");\n");
+  }
 
-lval* lval_eval(lenv* env, lval* val) {
-  if (val->type == LVAL_SYM) {
-    lval* result = lenv_get(env, val);
-    lval_del(val);
-    return result;
+  for (int i = 0; i < lemit.fn_count; i++) { lemit_fn(i); }
+
+  printf("\nint main(int argc, char** argv) {\n");
+  lemit.indent = 1;
+  lemit_line("laot_init(argc, argv);");
+  lemit_line("lenv* env = lenv_new();");
+  lemit_line("lenv_add_all_builtins(env);");
+  lemit_line("init_consts();");
+
+  for (int i = 0; i < line_count; i++) {
+    lval* line = lemit_strip(lines[i]);
+    lemit.temps = 0;
+    printf("\n  /* line %d */\n", starts[i]);
+    lemit_line("{");
+    lemit.indent++;
+    int result = lemit_expr(line, 0);
+    for (int j = 0; j < lemit.fn_count; j++) {
+      if (lemit.fns[j].line != i) { continue; }
+      lemit_line("if (lval_type_of(t%d) != LVAL_ERR) { lf%d_on = 1; }",
+                 result, j);
+    }
+    lemit_line("lval_println(t%d);", result);
+    lemit_line("lval_del(t%d);", result);
+    lemit_line("lgc_poll();");
+    lemit.indent--;
+    lemit_line("}");
   }
 
-  if (val->type == LVAL_SEXPR) {
-    return lval_eval_sexpr(env, val);
+  printf("\n  lenv_del(env);\n  return 0;\n}\n");
+
+  /* the constants, now that all of them are known */
+  printf("\nvoid init_consts(void) {\n");
+  printf("  k = malloc(sizeof(lval*) * %d);\n", lemit.const_count + 1);
+  for (int i = 0; i < lemit.const_count; i++) {
+    printf("  k[%d] = ", i);
+    lemit_value(lemit.consts[i]);
+    printf(";\n");
   }
+  printf("}\n");
 
-  return val;
+  for (int i = 0; i < line_count; i++) { lval_del(lines[i]); }
+  free(lines);
+  free(starts);
+  fflush(stdout);
+  return 0;
 }
 
 
@@ -560,41 +7105,59 @@ void lenv_add_builtin(lenv* env, char* name, lbuiltin func) {
 }
 
 void lenv_add_all_builtins(lenv* env) {
-  lenv_add_builtin(env, "list", builtin_list);
-  lenv_add_builtin(env, "head", builtin_head);
-  lenv_add_builtin(env, "tail", builtin_tail);
-  lenv_add_builtin(env, "eval", builtin_eval);
-  lenv_add_builtin(env, "join", builtin_join);
-  lenv_add_builtin(env, "def", builtin_def);
+  lsym_init_keywords();
 
-  lenv_add_builtin(env, "+", builtin_add);
-  lenv_add_builtin(env, "*", builtin_mul);
-  lenv_add_builtin(env, "-", builtin_sub);
-  lenv_add_builtin(env, "/", builtin_div);
+  for (int i = 0; i < LBUILTIN_COUNT; i++) {
+    lenv_add_builtin(env, lbuiltins[i].name, lbuiltins[i].fun);
+  }
 }
 
 
+#ifndef LISPY_RUNTIME
 int main(int argc, char** argv) {
-  mpc_parser_t* Number = mpc_new("number");
-  mpc_parser_t* Symbol = mpc_new("symbol");
-  mpc_parser_t* SExpr = mpc_new("sexpr");
-  mpc_parser_t* QExpr = mpc_new("qexpr");
-  mpc_parser_t* Expr = mpc_new("expr");
-  mpc_parser_t* Lispy = mpc_new("lispy");
+  char* bench = NULL;
+  char* compile = NULL;
+  char* output = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--tree-walk") == 0) { vm_disabled = 1; }
+    if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) { bench = argv[++i]; }
+    if (strcmp(argv[i], "--gc-stats") == 0) { heap.verbose = 1; }
+    if (strcmp(argv[i], "--nursery") == 0) { nursery.enabled = 1; }
+    if (strcmp(argv[i], "--no-nursery") == 0) { nursery.enabled = 0; }
+    if (strcmp(argv[i], "--gc-threshold") == 0 && i + 1 < argc) {
+      heap.threshold = atol(argv[++i]);
+    }
+    if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+      ldepth.max = atol(argv[++i]);
+    }
+    if (strcmp(argv[i], "--no-jit") == 0) { jit.threshold = 0; }
+    if (strcmp(argv[i], "--jit-threshold") == 0 && i + 1 < argc) {
+      jit.threshold = atol(argv[++i]);
+    }
+    if (strcmp(argv[i], "--perf-map") == 0) { jit.perf_map = 1; }
+    if (strcmp(argv[i], "--no-fold") == 0) { lfold.enabled = 0; }
+    if (strcmp(argv[i], "--no-eval-cache") == 0) {
+      lquoted_cache.enabled = 0;
+    }
+    if (strcmp(argv[i], "--fold-stats") == 0) { lfold.verbose = 1; }
+    if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+      compile = argv[++i];
+    }
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) { output = argv[++i]; }
+  }
 
+  if (bench) {
+    lgrammar_init();
+    return bench_run(bench);
+  }
 
-  // Grammar
+  if (compile) {
+    lgrammar_init();
+    lsym_init_keywords();
+    return laot_compile_file(compile, output);
+  }
 
-  mpca_lang(MPCA_LANG_DEFAULT,
-    "                                                   \
-     number : /-?[0-9]+/ ;                              \
-     symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        \
-     sexpr  : '(' <expr>* ')' ;                         \
-     qexpr  : '{' <expr>* '}' ;                         \
-     expr   : <number> | <symbol> | <sexpr> | <qexpr> ; \
-     lispy  : /^/ <expr>* /$/ ;                         \
-    ",
-    Number, Symbol, SExpr, QExpr, Expr, Lispy);
+  lgrammar_init();
 
   puts("Lispy Version 0.0.0.0.1");
   puts("Press Ctrl+c to Exit\n");
@@ -607,14 +7170,20 @@ int main(int argc, char** argv) {
 
   while (1) {
     char* input = readline("lispy> ");
+    if (!input) { break; }
     add_history(input);
 
     mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      lval* val = lval_eval(env, lval_read(r.output));
+    lval* err = lval_read_depth(input);
+    if (err) {
+      lval_println(err);
+      lval_del(err);
+    } else if (mpc_parse("<stdin>", input, grammar.Lispy, &r)) {
+      lval* val = lval_run(env, lfold_line(env, lval_read(r.output)));
       lval_println(val);
       lval_del(val);
       mpc_ast_delete(r.output);
+      lgc_poll();
     } else {
       mpc_err_print(r.error);
       mpc_err_delete(r.error);
@@ -624,7 +7193,8 @@ int main(int argc, char** argv) {
   }
 
   lenv_del(env);
-  mpc_cleanup(6, Number, Symbol, SExpr, QExpr, Expr, Lispy);
+  lgrammar_cleanup();
 
   return 0;
 }
+#endif